@@ -0,0 +1,163 @@
+#include "renderer/raytracer/raytracer.h"
+#include "world/camera.h"
+#include "world/model.h"
+
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+// Renders the Cornell box with the same shaders bound through std::function and at compile time, then
+// prints the time of both and checks that the images match. Usage: ShaderBindingBenchmark [model_path]
+
+using namespace cg::renderer;
+
+namespace {
+    constexpr unsigned int image_size = 512;
+    constexpr size_t depth = 3;
+    constexpr size_t frames = 1;
+
+    // Bounce directions come from a hash of the hit position instead of a random generator, so both runs
+    // trace exactly the same rays
+    float3 hash_direction(const float3 &position) {
+        uint32_t bits[3];
+        std::memcpy(bits, &position, sizeof(bits));
+        uint32_t state = bits[0] * 0x9E3779B1u ^ bits[1] * 0x85EBCA77u ^ bits[2] * 0xC2B2AE3Du;
+        float3 result;
+        for (int axis = 0; axis < 3; ++axis) {
+            state = state * 747796405u + 2891336453u;
+            uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+            word = (word >> 22u) ^ word;
+            result[axis] = static_cast<float>(word >> 8) / static_cast<float>(1 << 23) - 1.0f;
+        }
+        return result;
+    }
+
+    struct cornell_box_shading {
+        std::vector<light> lights;
+
+        payload miss(const ray &) const {
+            payload p{};
+            p.color = {0.0f, 0.0f, 0.0f};
+            return p;
+        }
+
+        template<typename RAYTRACER>
+        payload closest_hit(const RAYTRACER &raytracer, const ray &ray, payload &payload,
+                            const triangle<cg::vertex> &triangle, size_t depth) const {
+            float3 position = ray.position + ray.direction * payload.t;
+            float3 normal = normalize(
+                    payload.bary.x * triangle.na +
+                    payload.bary.y * triangle.nb +
+                    payload.bary.z * triangle.nc);
+            float3 result_color = triangle.emissive;
+            for (auto &light: lights) {
+                cg::renderer::ray to_light(position, light.position - position);
+                if (!raytracer.occluded(to_light, length(light.position - position))) {
+                    result_color += triangle.diffuse * light.color * std::max(dot(normal, to_light.direction), 0.0f);
+                }
+            }
+            float3 bounce_direction = hash_direction(position);
+            if (dot(normal, bounce_direction) < 0.0f) {
+                bounce_direction = -bounce_direction;
+            }
+            cg::renderer::ray to_next_object(position, bounce_direction);
+            auto payload_next = raytracer.trace_ray(to_next_object, depth);
+            result_color += triangle.diffuse * payload_next.color.to_float3() *
+                            std::max(dot(normal, to_next_object.direction), 0.0f);
+            payload.color = cg::color::from_float3(result_color);
+            return payload;
+        }
+    };
+
+    template<typename RAYTRACER>
+    long long render(RAYTRACER &raytracer, const cg::world::camera &camera) {
+        raytracer.clear_render_target({0, 0, 0});
+        raytracer.reset_ray_statistics();
+        auto start = std::chrono::high_resolution_clock::now();
+        raytracer.ray_generation(camera.get_position(), camera.get_direction(), camera.get_right(), camera.get_up(),
+                                 depth, frames);
+        auto end = std::chrono::high_resolution_clock::now();
+        auto render_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+        auto ray_statistics = raytracer.get_ray_statistics();
+        std::cout << "Render time: " << render_time << "ms, Mrays/s: "
+                  << static_cast<float>(ray_statistics.rays) / 1000.0f / static_cast<float>(std::max<long long>(render_time, 1))
+                  << std::endl;
+        return render_time;
+    }
+}// namespace
+
+int main(int argc, char **argv) {
+    try {
+        std::filesystem::path model_path = argc > 1 ? argv[1] : "models/CornellBox-Original.obj";
+        cg::world::model model;
+        model.load_obj(model_path);
+
+        cg::world::camera camera;
+        camera.set_width(static_cast<float>(image_size));
+        camera.set_height(static_cast<float>(image_size));
+        camera.set_position(float3{0.0f, 1.0f, 2.0f});
+        camera.set_angle_of_view(60.0f);
+
+        cornell_box_shading shading;
+        shading.lights.push_back({float3{-0.24f, 1.97f, 0.16f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
+        shading.lights.push_back({float3{-0.24f, 1.97f, -0.22f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
+        shading.lights.push_back({float3{0.23f, 1.97f, -0.22f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
+        shading.lights.push_back({float3{0.23f, 1.97f, 0.16f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
+
+        auto function_target = std::make_shared<cg::resource<cg::unsigned_color>>(image_size, image_size);
+        raytracer<cg::vertex, cg::unsigned_color> function_raytracer;
+        function_raytracer.set_viewport(image_size, image_size);
+        function_raytracer.set_render_target(function_target);
+        function_raytracer.set_vertex_buffers(model.get_vertex_buffers());
+        function_raytracer.set_index_buffers(model.get_index_buffers());
+        for (unsigned int shape = 0; shape < model.get_index_buffers().size(); ++shape) {
+            function_raytracer.add_instance(shape, model.get_world_matrix());
+        }
+        function_raytracer.build_acceleration_structure();
+        function_raytracer.miss_shader = [&shading](const ray &ray) {
+            return shading.miss(ray);
+        };
+        function_raytracer.closest_hit_shader = [&shading, &function_raytracer](
+                const ray &ray, payload &payload, const triangle<cg::vertex> &triangle, size_t depth) {
+            return shading.closest_hit(function_raytracer, ray, payload, triangle, depth);
+        };
+
+        auto static_target = std::make_shared<cg::resource<cg::unsigned_color>>(image_size, image_size);
+        auto static_shaders = make_static_shaders(
+                [&shading](const ray &ray) {
+                    return shading.miss(ray);
+                },
+                [&shading](const auto &raytracer, const ray &ray, payload &payload,
+                           const triangle<cg::vertex> &triangle, size_t depth) {
+                    return shading.closest_hit(raytracer, ray, payload, triangle, depth);
+                });
+        raytracer<cg::vertex, cg::unsigned_color, decltype(static_shaders)> static_raytracer(static_shaders);
+        static_raytracer.set_viewport(image_size, image_size);
+        static_raytracer.set_render_target(static_target);
+        static_raytracer.set_acceleration_structure(function_raytracer.get_acceleration_structure());
+
+        // Alternate the runs and keep the best time of each to filter out noise
+        long long function_time = LLONG_MAX;
+        long long static_time = LLONG_MAX;
+        for (int run = 0; run < 3; ++run) {
+            std::cout << "std::function shaders" << std::endl;
+            function_time = std::min(function_time, render(function_raytracer, camera));
+            std::cout << "Compile time shaders" << std::endl;
+            static_time = std::min(static_time, render(static_raytracer, camera));
+        }
+        size_t mismatches = 0;
+        for (size_t i = 0; i < function_target->get_number_of_elements(); ++i) {
+            const auto &a = function_target->item(i);
+            const auto &b = static_target->item(i);
+            mismatches += a.r != b.r || a.g != b.g || a.b != b.b;
+        }
+        std::cout << "Best render time: std::function " << function_time << "ms, compile time " << static_time
+                  << "ms, speedup " << static_cast<float>(function_time) / static_cast<float>(std::max<long long>(static_time, 1))
+                  << ", mismatching pixels: " << mismatches << std::endl;
+        return mismatches == 0 ? 0 : 1;
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
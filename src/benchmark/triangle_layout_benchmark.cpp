@@ -0,0 +1,237 @@
+#include "renderer/raytracer/raytracer.h"
+#include "world/camera.h"
+#include "world/model.h"
+
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+// Traces the same rays through the BVHs of a model twice, once testing the leaves against whole triangles stored
+// one after the other, once against the packed triangle packets the raytracer uses. Prints the time of both and
+// checks that they find the same hits. Usage: TriangleLayoutBenchmark [model_path]
+
+using namespace cg::renderer;
+
+namespace {
+    using tracer = raytracer<cg::vertex, cg::unsigned_color>;
+
+    constexpr unsigned int image_size = 512;
+    constexpr unsigned int random_ray_count = image_size * image_size;
+    constexpr float min_t = 0.001f;
+    constexpr float max_t = 1000.0f;
+
+    struct hit {
+        float t = max_t;
+        int mesh = -1;
+        int slot = -1;
+    };
+
+    // Array of structures layout: every slot of the BVH order as a whole triangle, padding slots stay degenerate
+    std::vector<triangle<cg::vertex>> get_triangles(const blas<cg::vertex> &mesh) {
+        const auto &primitive_indices = mesh.get_bvh().get_primitive_indices();
+        std::vector<triangle<cg::vertex>> triangles(primitive_indices.size(), triangle<cg::vertex>{});
+        for (unsigned int slot = 0; slot < primitive_indices.size(); ++slot) {
+            if (primitive_indices[slot] != bvh<cg::vertex>::invalid_primitive) {
+                triangles[slot] = mesh.get_triangle(slot);
+            }
+        }
+        return triangles;
+    }
+
+    // Nearest child first traversal of the binary BVH, shared by both layouts. leaf tests a range of slots and
+    // shrinks closest_t
+    template<typename LEAF>
+    void traverse(const bvh<cg::vertex> &tree, const ray &ray, const float3 &inv_ray_direction, float &closest_t,
+                  LEAF &&leaf) {
+        const auto &nodes = tree.get_nodes();
+        float t_node;
+        if (nodes.empty() || !nodes[0].bounds.aabb_test(ray, inv_ray_direction, closest_t, t_node)) {
+            return;
+        }
+        unsigned int stack[bvh<cg::vertex>::max_depth];
+        unsigned int stack_size = 0;
+        unsigned int node_id = 0;
+        while (true) {
+            const auto &node = nodes[node_id];
+            if (node.primitive_count > 0) {
+                leaf(node.offset, node.primitive_count);
+            }
+            else {
+                unsigned int near_child = node_id + 1;
+                unsigned int far_child = node.offset;
+                float t_near, t_far;
+                bool hit_near = nodes[near_child].bounds.aabb_test(ray, inv_ray_direction, closest_t, t_near);
+                bool hit_far = nodes[far_child].bounds.aabb_test(ray, inv_ray_direction, closest_t, t_far);
+                if (hit_near && hit_far) {
+                    if (t_far < t_near) {
+                        std::swap(near_child, far_child);
+                    }
+                    stack[stack_size++] = far_child;
+                }
+                if (hit_near || hit_far) {
+                    node_id = hit_near ? near_child : far_child;
+                    continue;
+                }
+            }
+            if (stack_size == 0) {
+                return;
+            }
+            node_id = stack[--stack_size];
+        }
+    }
+
+    hit trace_triangles(const tracer &raytracer, const std::vector<blas<cg::vertex>> &meshes,
+                        const std::vector<std::vector<triangle<cg::vertex>>> &triangles, const ray &ray) {
+        hit closest;
+        float3 inv_ray_direction = 1.0f / ray.direction;
+        for (unsigned int mesh_id = 0; mesh_id < meshes.size(); ++mesh_id) {
+            const auto &mesh_triangles = triangles[mesh_id];
+            traverse(meshes[mesh_id].get_bvh(), ray, inv_ray_direction, closest.t,
+                     [&](unsigned int first_triangle, unsigned int triangle_count) {
+                         for (unsigned int slot = first_triangle; slot < first_triangle + triangle_count; ++slot) {
+                             auto payload = raytracer.intersection_shader(mesh_triangles[slot], ray);
+                             if (payload.t > min_t && payload.t < closest.t) {
+                                 closest = {payload.t, static_cast<int>(mesh_id), static_cast<int>(slot)};
+                             }
+                         }
+                     });
+        }
+        return closest;
+    }
+
+    hit trace_packets(const std::vector<blas<cg::vertex>> &meshes, const ray &ray) {
+        hit closest;
+        float3 inv_ray_direction = 1.0f / ray.direction;
+        for (unsigned int mesh_id = 0; mesh_id < meshes.size(); ++mesh_id) {
+            const auto &packets = meshes[mesh_id].get_packets();
+            traverse(meshes[mesh_id].get_bvh(), ray, inv_ray_direction, closest.t,
+                     [&](unsigned int first_triangle, unsigned int triangle_count) {
+                         float3 bary;
+                         int slot = tracer::intersect_packets(&packets[first_triangle / triangle_packet::width],
+                                                              triangle_count, ray, min_t, closest.t, bary);
+                         if (slot >= 0) {
+                             closest.mesh = static_cast<int>(mesh_id);
+                             closest.slot = static_cast<int>(first_triangle) + slot;
+                         }
+                     });
+        }
+        return closest;
+    }
+
+    template<typename TRACE>
+    long long run(const char *name, const std::vector<ray> &rays, std::vector<hit> &hits, TRACE &&trace) {
+        auto start = std::chrono::high_resolution_clock::now();
+#pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < static_cast<int>(rays.size()); ++i) {
+            hits[i] = trace(rays[i]);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        auto time = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        std::cout << name << ": " << time / 1000 << "ms, Mrays/s: "
+                  << static_cast<float>(rays.size()) / static_cast<float>(std::max<long long>(time, 1)) << std::endl;
+        return time;
+    }
+
+    size_t count_mismatches(const std::vector<hit> &a, const std::vector<hit> &b) {
+        size_t mismatches = 0;
+        for (size_t i = 0; i < a.size(); ++i) {
+            // The kernels may round t differently, a hit on the shared edge of two triangles can go either way
+            bool same_slot = a[i].mesh == b[i].mesh && a[i].slot == b[i].slot;
+            mismatches += !same_slot && std::abs(a[i].t - b[i].t) > 1e-4f * std::max(a[i].t, 1.0f);
+        }
+        return mismatches;
+    }
+}// namespace
+
+int main(int argc, char **argv) {
+    try {
+        std::filesystem::path model_path = argc > 1 ? argv[1] : "models/CornellBox-Original.obj";
+        cg::world::model model;
+        model.load_obj(model_path);
+
+        std::vector<blas<cg::vertex>> meshes(model.get_index_buffers().size());
+        std::vector<std::vector<triangle<cg::vertex>>> triangles(meshes.size());
+        aabb<cg::vertex> bounds;
+        size_t slot_count = 0;
+        for (unsigned int shape = 0; shape < meshes.size(); ++shape) {
+            const auto &index_buffer = model.get_index_buffers()[shape];
+            const auto &vertex_buffer = model.get_vertex_buffers()[shape];
+            std::vector<triangle<cg::vertex>> shape_triangles;
+            for (size_t index = 0; index + 2 < index_buffer->get_number_of_elements(); index += 3) {
+                shape_triangles.emplace_back(vertex_buffer->item(index_buffer->item(index)),
+                                             vertex_buffer->item(index_buffer->item(index + 1)),
+                                             vertex_buffer->item(index_buffer->item(index + 2)));
+            }
+            meshes[shape].build(std::move(shape_triangles));
+            triangles[shape] = get_triangles(meshes[shape]);
+            bounds.add_aabb(meshes[shape].get_bounds());
+            slot_count += triangles[shape].size();
+        }
+        std::cout << "Triangle slots: " << slot_count << ", bytes per slot: triangles " << sizeof(triangle<cg::vertex>)
+                  << ", packets " << sizeof(triangle_packet) / triangle_packet::width << " hot + "
+                  << sizeof(triangle_shading) << " cold" << std::endl;
+
+        cg::world::camera camera;
+        camera.set_width(static_cast<float>(image_size));
+        camera.set_height(static_cast<float>(image_size));
+        camera.set_position(float3{0.0f, 1.0f, 2.0f});
+        camera.set_angle_of_view(60.0f);
+        std::vector<ray> camera_rays;
+        camera_rays.reserve(image_size * image_size);
+        for (unsigned int y = 0; y < image_size; ++y) {
+            for (unsigned int x = 0; x < image_size; ++x) {
+                float u = (2.0f * static_cast<float>(x)) / static_cast<float>(image_size - 1) - 1.0f;
+                float v = (2.0f * static_cast<float>(y)) / static_cast<float>(image_size - 1) - 1.0f;
+                camera_rays.emplace_back(camera.get_position(),
+                                         camera.get_direction() + u * camera.get_right() - v * camera.get_up());
+            }
+        }
+        // Incoherent rays between random points of the model bounds, like bounces
+        std::vector<ray> random_rays;
+        random_rays.reserve(random_ray_count);
+        std::mt19937 generator(1);
+        std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+        auto random_point = [&]() {
+            float3 t{distribution(generator), distribution(generator), distribution(generator)};
+            return bounds.get_min() + t * (bounds.get_max() - bounds.get_min());
+        };
+        while (random_rays.size() < random_ray_count) {
+            float3 from = random_point();
+            float3 to = random_point();
+            if (length(to - from) > 0.0f) {
+                random_rays.emplace_back(from, to - from);
+            }
+        }
+
+        tracer raytracer;
+        auto trace_aos = [&](const ray &ray) {
+            return trace_triangles(raytracer, meshes, triangles, ray);
+        };
+        auto trace_soa = [&](const ray &ray) {
+            return trace_packets(meshes, ray);
+        };
+        size_t mismatches = 0;
+        for (const auto &[name, rays]: {std::pair{"Camera rays", &camera_rays}, std::pair{"Random rays", &random_rays}}) {
+            std::vector<hit> aos_hits(rays->size());
+            std::vector<hit> soa_hits(rays->size());
+            // Alternate the runs and keep the best time of each to filter out noise
+            long long aos_time = LLONG_MAX;
+            long long soa_time = LLONG_MAX;
+            for (int iteration = 0; iteration < 3; ++iteration) {
+                aos_time = std::min(aos_time, run("Triangles", *rays, aos_hits, trace_aos));
+                soa_time = std::min(soa_time, run("Packets", *rays, soa_hits, trace_soa));
+            }
+            size_t ray_mismatches = count_mismatches(aos_hits, soa_hits);
+            mismatches += ray_mismatches;
+            std::cout << name << ", best time: triangles " << aos_time / 1000 << "ms, packets " << soa_time / 1000
+                      << "ms, speedup " << static_cast<float>(aos_time) / static_cast<float>(std::max<long long>(soa_time, 1))
+                      << ", mismatching hits: " << ray_mismatches << std::endl;
+        }
+        return mismatches == 0 ? 0 : 1;
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace cg::renderer {
+    // Discrete distribution sampled in constant time (Walker's alias method, built with Vose's algorithm).
+    // Entry i is picked with probability weights[i] over the sum of the weights
+    class alias_table {
+    public:
+        alias_table() = default;
+
+        explicit alias_table(const std::vector<float> &weights);
+
+        // One uniform number in [0, 1) picks the bin and decides between the bin and its alias
+        uint32_t sample(float u) const;
+
+        float get_probability(uint32_t index) const;
+
+        float get_total_weight() const;
+
+        size_t size() const;
+
+        bool empty() const;
+
+    protected:
+        struct bin {
+            // Share of the bin that stays with its own entry
+            float threshold = 1.0f;
+            uint32_t alias = 0;
+        };
+
+        std::vector<bin> bins;
+        std::vector<float> probabilities;
+        float total_weight = 0.0f;
+    };
+
+    inline alias_table::alias_table(const std::vector<float> &weights) {
+        double sum = 0.0;
+        for (float weight: weights) {
+            sum += std::max(weight, 0.0f);
+        }
+        total_weight = static_cast<float>(sum);
+        if (weights.empty() || sum <= 0.0) {
+            return;
+        }
+        size_t count = weights.size();
+        bins.resize(count);
+        probabilities.resize(count);
+        // Weights scaled so the average bin holds exactly 1
+        std::vector<double> scaled(count);
+        std::vector<uint32_t> small;
+        std::vector<uint32_t> large;
+        for (uint32_t i = 0; i < count; ++i) {
+            probabilities[i] = static_cast<float>(std::max(weights[i], 0.0f) / sum);
+            scaled[i] = std::max(weights[i], 0.0f) / sum * static_cast<double>(count);
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+        // Every underfull bin is topped up from one overfull entry, which then becomes its alias
+        while (!small.empty() && !large.empty()) {
+            uint32_t less = small.back();
+            small.pop_back();
+            uint32_t more = large.back();
+            bins[less].threshold = static_cast<float>(scaled[less]);
+            bins[less].alias = more;
+            scaled[more] -= 1.0 - scaled[less];
+            if (scaled[more] < 1.0) {
+                large.pop_back();
+                small.push_back(more);
+            }
+        }
+        // What is left is full up to rounding
+        for (uint32_t i: small) {
+            bins[i] = {1.0f, i};
+        }
+        for (uint32_t i: large) {
+            bins[i] = {1.0f, i};
+        }
+    }
+
+    inline uint32_t alias_table::sample(float u) const {
+        float scaled = u * static_cast<float>(bins.size());
+        auto index = std::min(static_cast<uint32_t>(scaled), static_cast<uint32_t>(bins.size() - 1));
+        return scaled - static_cast<float>(index) < bins[index].threshold ? index : bins[index].alias;
+    }
+
+    inline float alias_table::get_probability(uint32_t index) const {
+        return probabilities[index];
+    }
+
+    inline float alias_table::get_total_weight() const {
+        return total_weight;
+    }
+
+    inline size_t alias_table::size() const {
+        return bins.size();
+    }
+
+    inline bool alias_table::empty() const {
+        return bins.empty();
+    }
+}// namespace cg::renderer
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <linalg.h>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer {
+    // Direction picked by a BSDF with its solid angle pdf. weight is the BSDF times the cosine over the pdf,
+    // what the light coming back along direction is multiplied by
+    struct bsdf_sample {
+        float3 direction{0.0f, 0.0f, 1.0f};
+        float3 weight{0.0f};
+        float pdf = 0.0f;
+    };
+
+    // Any type with the members of lambertian_bsdf plugs into the path tracer: evaluate gives the BSDF for
+    // the view direction wo and light direction wi, both pointing away from the surface, pdf the density
+    // sample picks wi with. Lobes are added as more such types
+    class lambertian_bsdf {
+    public:
+        explicit lambertian_bsdf(const float3 &in_albedo);
+
+        float3 evaluate(const float3 &normal, const float3 &wo, const float3 &wi) const;
+
+        float pdf(const float3 &normal, const float3 &wo, const float3 &wi) const;
+
+        // Cosine weighted over the hemisphere of the normal, the weight is the albedo
+        bsdf_sample sample(const float3 &normal, const float3 &wo, const float2 &u) const;
+
+    protected:
+        float3 albedo;
+    };
+
+    constexpr float pi = 3.14159265358979323846f;
+
+    // Tangent and bitangent completing a unit normal to an orthonormal basis (Duff et al. 2017)
+    inline void make_basis(const float3 &normal, float3 &tangent, float3 &bitangent) {
+        float sign = std::copysign(1.0f, normal.z);
+        float a = -1.0f / (sign + normal.z);
+        float b = normal.x * normal.y * a;
+        tangent = float3{1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x};
+        bitangent = float3{b, sign + normal.y * normal.y * a, -normal.y};
+    }
+
+    inline lambertian_bsdf::lambertian_bsdf(const float3 &in_albedo) : albedo(in_albedo) {}
+
+    inline float3 lambertian_bsdf::evaluate(const float3 &normal, const float3 & /*wo*/, const float3 &wi) const {
+        return dot(normal, wi) > 0.0f ? albedo / pi : float3{0.0f};
+    }
+
+    inline float lambertian_bsdf::pdf(const float3 &normal, const float3 & /*wo*/, const float3 &wi) const {
+        return std::max(dot(normal, wi), 0.0f) / pi;
+    }
+
+    inline bsdf_sample lambertian_bsdf::sample(const float3 &normal, const float3 & /*wo*/, const float2 &u) const {
+        float3 tangent;
+        float3 bitangent;
+        make_basis(normal, tangent, bitangent);
+        float radius = std::sqrt(u.x);
+        float phi = 2.0f * pi * u.y;
+        float cosine = std::sqrt(std::max(0.0f, 1.0f - u.x));
+        bsdf_sample result;
+        result.direction = tangent * (radius * std::cos(phi)) + bitangent * (radius * std::sin(phi)) + normal * cosine;
+        result.pdf = cosine / pi;
+        result.weight = result.pdf > 0.0f ? albedo : float3{0.0f};
+        return result;
+    }
+}// namespace cg::renderer
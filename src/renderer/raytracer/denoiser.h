@@ -0,0 +1,504 @@
+#pragma once
+
+#include "renderer/raytracer/simd.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <linalg.h>
+#include <vector>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer {
+    // Edge avoiding à-trous wavelet filter (Dammertz et al. 2010) with the variance guided luminance weight of
+    // SVGF (Schied et al. 2017). Each pass is a 5x5 B3 spline kernel with its taps spread 2^pass pixels
+    // apart. Taps are weighted down by their difference from the center in first hit normal, albedo, depth and
+    // in luminance relative to the noise the center is expected to have. The light is divided by the albedo
+    // before filtering, so the filter only blurs lighting and keeps the surface colors sharp
+    class atrous_denoiser {
+    public:
+        // All arrays have width * height row major entries and result may be radiance. variance is the variance
+        // of the luminance of the radiance estimate, the sample variance over the sample count. Pixels with a
+        // depth of 0, whose rays missed the scene, are copied
+        void denoise(const float3 *radiance, const float *variance, const float3 *normal, const float3 *albedo,
+                     const float *depth, float3 *result, size_t in_width, size_t in_height);
+
+        static constexpr int passes = 5;
+        // How many standard deviations apart luminances may be and still mix
+        static constexpr float sigma_luminance = 4.0f;
+        static constexpr float sigma_depth = 1.0f;
+        static constexpr float sigma_albedo = 0.1f;
+        // Albedo channels are divided out above this, black surfaces keep their light as is
+        static constexpr float min_albedo = 0.01f;
+
+    protected:
+        // Planes of one pass, split by channel so 4 or 8 neighbouring pixels load together
+        struct pass_planes {
+            const float *color[3];
+            const float *variance;
+            float *filtered_color[3];
+            float *filtered_variance;
+            // Weight of the tap and the reciprocal of its distance in pixels, 0 for the center
+            float kernel[25];
+            float inv_distance[25];
+            int offset_x[25];
+            int offset_y[25];
+        };
+
+        void prepare_guides(const float3 *normal, const float3 *albedo, const float *depth);
+
+        // 1 / (sigma_luminance * standard deviation), from the variance blurred over 3x3 pixels
+        void prepare_luminance_scale(const float *in_variance);
+
+        void filter_pixel(const pass_planes &planes, int x, int y) const;
+
+#ifdef CG_SIMD_X86
+        void filter_pixels_4_sse(const pass_planes &planes, int x, int y) const;
+
+        CG_TARGET_AVX void filter_pixels_8_avx(const pass_planes &planes, int x, int y) const;
+#endif
+
+        int width = 0;
+        int height = 0;
+        std::vector<float> color[2][3];
+        std::vector<float> variance[2];
+        std::vector<float> normal_planes[3];
+        std::vector<float> albedo_planes[3];
+        std::vector<float> depth_plane;
+        // 1 / (sigma_depth * depth gradient + a small share of the depth), per pixel of distance
+        std::vector<float> inv_depth_scale;
+        std::vector<float> inv_luminance_scale;
+    };
+
+    // The exponent is clamped to [-125, 0], a weight that small is as good as 0
+    constexpr float min_weight_exponent = -125.0f;
+
+    // 2^x for x in [-125, 0] within 3e-4 relative error. x is split at its integer part, the fraction goes
+    // through a Taylor polynomial and the integer part into the exponent bits. The SIMD kernels evaluate it
+    // with the same operations, so all paths weight the taps alike
+    inline float exp2_weight(float x) {
+        x = std::max(x, min_weight_exponent);
+        // Truncation rounds up for negative x, the fraction is in (-1, 0]
+        int32_t integer = static_cast<int32_t>(x);
+        float f = x - static_cast<float>(integer);
+        float p = 1.0f + f * (0.6931472f + f * (0.2402265f + f * (0.05550411f + f * (0.009618129f +
+                  f * 0.001333356f))));
+        int32_t bits;
+        std::memcpy(&bits, &p, sizeof(bits));
+        bits += integer * (1 << 23);
+        std::memcpy(&p, &bits, sizeof(p));
+        return p;
+    }
+
+    inline void atrous_denoiser::denoise(const float3 *radiance, const float *in_variance, const float3 *normal,
+                                         const float3 *albedo, const float *depth, float3 *result,
+                                         size_t in_width, size_t in_height) {
+        width = static_cast<int>(in_width);
+        height = static_cast<int>(in_height);
+        int pixel_count = width * height;
+        for (int buffer = 0; buffer < 2; ++buffer) {
+            for (auto &channel: color[buffer]) {
+                channel.resize(pixel_count);
+            }
+            variance[buffer].resize(pixel_count);
+        }
+        inv_luminance_scale.resize(pixel_count);
+        prepare_guides(normal, albedo, depth);
+#pragma omp parallel for
+        for (int i = 0; i < pixel_count; ++i) {
+            float3 surface = max(albedo[i], float3{min_albedo});
+            float3 light = radiance[i] / surface;
+            color[0][0][i] = light.x;
+            color[0][1][i] = light.y;
+            color[0][2][i] = light.z;
+            float surface_luminance = dot(surface, float3{0.2126f, 0.7152f, 0.0722f});
+            variance[0][i] = in_variance[i] / (surface_luminance * surface_luminance);
+        }
+        constexpr float b3_spline[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+        for (int pass = 0; pass < passes; ++pass) {
+            int source = pass % 2;
+            int step = 1 << pass;
+            pass_planes planes{};
+            for (int channel = 0; channel < 3; ++channel) {
+                planes.color[channel] = color[source][channel].data();
+                planes.filtered_color[channel] = color[1 - source][channel].data();
+            }
+            planes.variance = variance[source].data();
+            planes.filtered_variance = variance[1 - source].data();
+            for (int tap = 0; tap < 25; ++tap) {
+                int tap_x = tap % 5 - 2;
+                int tap_y = tap / 5 - 2;
+                planes.kernel[tap] = b3_spline[tap_x + 2] * b3_spline[tap_y + 2];
+                planes.offset_x[tap] = tap_x * step;
+                planes.offset_y[tap] = tap_y * step;
+                int distance = (std::abs(tap_x) + std::abs(tap_y)) * step;
+                planes.inv_distance[tap] = distance > 0 ? 1.0f / static_cast<float>(distance) : 0.0f;
+            }
+            prepare_luminance_scale(planes.variance);
+            // Rows differ little in cost
+#pragma omp parallel for
+            for (int y = 0; y < height; ++y) {
+                int x = 0;
+                // Pixels whose taps are all inside the row go through the SIMD kernels
+                int reach = 2 * step;
+                for (; x < std::min(reach, width); ++x) {
+                    filter_pixel(planes, x, y);
+                }
+#ifdef CG_SIMD_X86
+                simd::isa isa = simd::get_isa();
+                if (isa == simd::isa::avx2) {
+                    for (; x + 8 + reach <= width; x += 8) {
+                        filter_pixels_8_avx(planes, x, y);
+                    }
+                }
+                if (isa != simd::isa::scalar) {
+                    for (; x + 4 + reach <= width; x += 4) {
+                        filter_pixels_4_sse(planes, x, y);
+                    }
+                }
+#endif
+                for (; x < width; ++x) {
+                    filter_pixel(planes, x, y);
+                }
+            }
+        }
+        int last = passes % 2;
+#pragma omp parallel for
+        for (int i = 0; i < pixel_count; ++i) {
+            if (depth_plane[i] <= 0.0f) {
+                result[i] = radiance[i];
+                continue;
+            }
+            float3 surface = max(albedo[i], float3{min_albedo});
+            result[i] = float3{color[last][0][i], color[last][1][i], color[last][2][i]} * surface;
+        }
+    }
+
+    inline void atrous_denoiser::prepare_guides(const float3 *normal, const float3 *albedo, const float *depth) {
+        int pixel_count = width * height;
+        for (int channel = 0; channel < 3; ++channel) {
+            normal_planes[channel].resize(pixel_count);
+            albedo_planes[channel].resize(pixel_count);
+        }
+        depth_plane.assign(depth, depth + pixel_count);
+        inv_depth_scale.resize(pixel_count);
+        // The smaller one sided difference, a neighbour across an edge does not count as the slope
+        auto get_slope = [this](int i, int previous, int next) {
+            float slope = FLT_MAX;
+            if (previous >= 0 && depth_plane[previous] > 0.0f) {
+                slope = std::abs(depth_plane[i] - depth_plane[previous]);
+            }
+            if (next >= 0 && depth_plane[next] > 0.0f) {
+                slope = std::min(slope, std::abs(depth_plane[next] - depth_plane[i]));
+            }
+            return slope == FLT_MAX ? 0.0f : slope;
+        };
+#pragma omp parallel for
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                int i = y * width + x;
+                // Averaged over the pixel, the normal is shorter than 1 at edges
+                float3 unit_normal = length2(normal[i]) > 0.0f ? normalize(normal[i]) : float3{0.0f};
+                for (int channel = 0; channel < 3; ++channel) {
+                    normal_planes[channel][i] = unit_normal[channel];
+                    albedo_planes[channel][i] = albedo[i][channel];
+                }
+                float slope_x = get_slope(i, x > 0 ? i - 1 : -1, x + 1 < width ? i + 1 : -1);
+                float slope_y = get_slope(i, y > 0 ? i - width : -1, y + 1 < height ? i + width : -1);
+                float scale = sigma_depth * std::max(slope_x, slope_y) + 1e-3f * depth_plane[i];
+                inv_depth_scale[i] = scale > 0.0f ? 1.0f / scale : 0.0f;
+            }
+        }
+    }
+
+    inline void atrous_denoiser::prepare_luminance_scale(const float *in_variance) {
+        constexpr float gaussian[3] = {0.25f, 0.5f, 0.25f};
+#pragma omp parallel for
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                float sum = 0.0f;
+                float weight_sum = 0.0f;
+                for (int tap_y = -1; tap_y <= 1; ++tap_y) {
+                    for (int tap_x = -1; tap_x <= 1; ++tap_x) {
+                        int neighbour_x = x + tap_x;
+                        int neighbour_y = y + tap_y;
+                        if (neighbour_x < 0 || neighbour_x >= width || neighbour_y < 0 || neighbour_y >= height) {
+                            continue;
+                        }
+                        float weight = gaussian[tap_x + 1] * gaussian[tap_y + 1];
+                        sum += weight * in_variance[neighbour_y * width + neighbour_x];
+                        weight_sum += weight;
+                    }
+                }
+                float deviation = std::sqrt(std::max(sum / weight_sum, 0.0f));
+                inv_luminance_scale[y * width + x] = 1.0f / (sigma_luminance * deviation + 1e-4f);
+            }
+        }
+    }
+
+    // The weight of a tap multiplies the kernel, the normal similarity to the power of 128 and
+    // exp(-(luminance + depth + albedo distance)). The kernels below repeat it operation by operation
+    inline void atrous_denoiser::filter_pixel(const pass_planes &planes, int x, int y) const {
+        int center = y * width + x;
+        float center_depth = depth_plane[center];
+        if (center_depth <= 0.0f) {
+            for (int channel = 0; channel < 3; ++channel) {
+                planes.filtered_color[channel][center] = planes.color[channel][center];
+            }
+            planes.filtered_variance[center] = planes.variance[center];
+            return;
+        }
+        float center_luminance = (0.2126f * planes.color[0][center] + 0.7152f * planes.color[1][center]) +
+                                 0.0722f * planes.color[2][center];
+        float weight_sum = 0.0f;
+        float sum[3] = {0.0f, 0.0f, 0.0f};
+        float variance_sum = 0.0f;
+        for (int tap = 0; tap < 25; ++tap) {
+            int neighbour_x = x + planes.offset_x[tap];
+            int neighbour_y = y + planes.offset_y[tap];
+            if (neighbour_x < 0 || neighbour_x >= width || neighbour_y < 0 || neighbour_y >= height) {
+                continue;
+            }
+            int neighbour = neighbour_y * width + neighbour_x;
+            float cosine = (normal_planes[0][center] * normal_planes[0][neighbour] +
+                            normal_planes[1][center] * normal_planes[1][neighbour]) +
+                           normal_planes[2][center] * normal_planes[2][neighbour];
+            float normal_weight = std::max(cosine, 0.0f);
+            for (int square = 0; square < 7; ++square) {
+                normal_weight *= normal_weight;
+            }
+            float luminance = (0.2126f * planes.color[0][neighbour] + 0.7152f * planes.color[1][neighbour]) +
+                              0.0722f * planes.color[2][neighbour];
+            float luminance_distance = std::abs(center_luminance - luminance) * inv_luminance_scale[center];
+            float depth_distance = std::abs(center_depth - depth_plane[neighbour]) * inv_depth_scale[center] *
+                                   planes.inv_distance[tap];
+            float albedo_r = albedo_planes[0][center] - albedo_planes[0][neighbour];
+            float albedo_g = albedo_planes[1][center] - albedo_planes[1][neighbour];
+            float albedo_b = albedo_planes[2][center] - albedo_planes[2][neighbour];
+            float albedo_distance = ((albedo_r * albedo_r + albedo_g * albedo_g) + albedo_b * albedo_b) *
+                                    (1.0f / (sigma_albedo * sigma_albedo));
+            float exponent = ((luminance_distance + depth_distance) + albedo_distance) * -1.442695f;
+            float weight = planes.kernel[tap] * normal_weight * exp2_weight(exponent);
+            // Missed pixels do not mix into the surfaces
+            weight = depth_plane[neighbour] > 0.0f ? weight : 0.0f;
+            weight_sum += weight;
+            for (int channel = 0; channel < 3; ++channel) {
+                sum[channel] += weight * planes.color[channel][neighbour];
+            }
+            variance_sum += weight * weight * planes.variance[neighbour];
+        }
+        // The center weighs the kernel times its normal similarity, which is close to 1
+        float inv_weight_sum = weight_sum > 0.0f ? 1.0f / weight_sum : 0.0f;
+        for (int channel = 0; channel < 3; ++channel) {
+            planes.filtered_color[channel][center] = weight_sum > 0.0f ? sum[channel] * inv_weight_sum
+                                                                       : planes.color[channel][center];
+        }
+        planes.filtered_variance[center] = weight_sum > 0.0f ? variance_sum * inv_weight_sum * inv_weight_sum
+                                                              : planes.variance[center];
+    }
+
+#ifdef CG_SIMD_X86
+    inline __m128 exp2_weight_4_sse(__m128 x) {
+        x = _mm_max_ps(x, _mm_set1_ps(min_weight_exponent));
+        __m128i integer = _mm_cvttps_epi32(x);
+        __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(integer));
+        __m128 p = _mm_add_ps(_mm_set1_ps(0.009618129f), _mm_mul_ps(f, _mm_set1_ps(0.001333356f)));
+        p = _mm_add_ps(_mm_set1_ps(0.05550411f), _mm_mul_ps(f, p));
+        p = _mm_add_ps(_mm_set1_ps(0.2402265f), _mm_mul_ps(f, p));
+        p = _mm_add_ps(_mm_set1_ps(0.6931472f), _mm_mul_ps(f, p));
+        p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(f, p));
+        __m128i bits = _mm_add_epi32(_mm_castps_si128(p), _mm_slli_epi32(integer, 23));
+        return _mm_castsi128_ps(bits);
+    }
+
+    inline void atrous_denoiser::filter_pixels_4_sse(const pass_planes &planes, int x, int y) const {
+        int center = y * width + x;
+        __m128 zero = _mm_setzero_ps();
+        __m128 sign = _mm_set1_ps(-0.0f);
+        __m128 center_depth = _mm_loadu_ps(&depth_plane[center]);
+        __m128 center_color[3];
+        __m128 center_normal[3];
+        __m128 center_albedo[3];
+        for (int channel = 0; channel < 3; ++channel) {
+            center_color[channel] = _mm_loadu_ps(planes.color[channel] + center);
+            center_normal[channel] = _mm_loadu_ps(&normal_planes[channel][center]);
+            center_albedo[channel] = _mm_loadu_ps(&albedo_planes[channel][center]);
+        }
+        __m128 center_luminance = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.2126f), center_color[0]),
+                           _mm_mul_ps(_mm_set1_ps(0.7152f), center_color[1])),
+                _mm_mul_ps(_mm_set1_ps(0.0722f), center_color[2]));
+        __m128 luminance_scale = _mm_loadu_ps(&inv_luminance_scale[center]);
+        __m128 depth_scale = _mm_loadu_ps(&inv_depth_scale[center]);
+        __m128 albedo_scale = _mm_set1_ps(1.0f / (sigma_albedo * sigma_albedo));
+        __m128 weight_sum = zero;
+        __m128 sum[3] = {zero, zero, zero};
+        __m128 variance_sum = zero;
+        for (int tap = 0; tap < 25; ++tap) {
+            int neighbour_y = y + planes.offset_y[tap];
+            if (neighbour_y < 0 || neighbour_y >= height) {
+                continue;
+            }
+            int neighbour = neighbour_y * width + x + planes.offset_x[tap];
+            __m128 cosine = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(center_normal[0], _mm_loadu_ps(&normal_planes[0][neighbour])),
+                               _mm_mul_ps(center_normal[1], _mm_loadu_ps(&normal_planes[1][neighbour]))),
+                    _mm_mul_ps(center_normal[2], _mm_loadu_ps(&normal_planes[2][neighbour])));
+            __m128 normal_weight = _mm_max_ps(cosine, zero);
+            for (int square = 0; square < 7; ++square) {
+                normal_weight = _mm_mul_ps(normal_weight, normal_weight);
+            }
+            __m128 color_r = _mm_loadu_ps(planes.color[0] + neighbour);
+            __m128 color_g = _mm_loadu_ps(planes.color[1] + neighbour);
+            __m128 color_b = _mm_loadu_ps(planes.color[2] + neighbour);
+            __m128 luminance = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.2126f), color_r), _mm_mul_ps(_mm_set1_ps(0.7152f), color_g)),
+                    _mm_mul_ps(_mm_set1_ps(0.0722f), color_b));
+            __m128 luminance_distance = _mm_mul_ps(
+                    _mm_andnot_ps(sign, _mm_sub_ps(center_luminance, luminance)), luminance_scale);
+            __m128 depth = _mm_loadu_ps(&depth_plane[neighbour]);
+            __m128 depth_distance = _mm_mul_ps(
+                    _mm_mul_ps(_mm_andnot_ps(sign, _mm_sub_ps(center_depth, depth)), depth_scale),
+                    _mm_set1_ps(planes.inv_distance[tap]));
+            __m128 albedo_r = _mm_sub_ps(center_albedo[0], _mm_loadu_ps(&albedo_planes[0][neighbour]));
+            __m128 albedo_g = _mm_sub_ps(center_albedo[1], _mm_loadu_ps(&albedo_planes[1][neighbour]));
+            __m128 albedo_b = _mm_sub_ps(center_albedo[2], _mm_loadu_ps(&albedo_planes[2][neighbour]));
+            __m128 albedo_distance = _mm_mul_ps(
+                    _mm_add_ps(_mm_add_ps(_mm_mul_ps(albedo_r, albedo_r), _mm_mul_ps(albedo_g, albedo_g)),
+                               _mm_mul_ps(albedo_b, albedo_b)),
+                    albedo_scale);
+            __m128 exponent = _mm_mul_ps(
+                    _mm_add_ps(_mm_add_ps(luminance_distance, depth_distance), albedo_distance),
+                    _mm_set1_ps(-1.442695f));
+            __m128 weight = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(planes.kernel[tap]), normal_weight),
+                                       exp2_weight_4_sse(exponent));
+            weight = _mm_and_ps(weight, _mm_cmpgt_ps(depth, zero));
+            weight_sum = _mm_add_ps(weight_sum, weight);
+            sum[0] = _mm_add_ps(sum[0], _mm_mul_ps(weight, color_r));
+            sum[1] = _mm_add_ps(sum[1], _mm_mul_ps(weight, color_g));
+            sum[2] = _mm_add_ps(sum[2], _mm_mul_ps(weight, color_b));
+            variance_sum = _mm_add_ps(variance_sum,
+                                      _mm_mul_ps(_mm_mul_ps(weight, weight), _mm_loadu_ps(planes.variance + neighbour)));
+        }
+        // Missed centers and centers without weight keep their values, as in filter_pixel
+        __m128 filtered = _mm_and_ps(_mm_cmpgt_ps(center_depth, zero), _mm_cmpgt_ps(weight_sum, zero));
+        __m128 inv_weight_sum = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1.0f), weight_sum), filtered);
+        for (int channel = 0; channel < 3; ++channel) {
+            __m128 result = _mm_or_ps(_mm_and_ps(filtered, _mm_mul_ps(sum[channel], inv_weight_sum)),
+                                      _mm_andnot_ps(filtered, center_color[channel]));
+            _mm_storeu_ps(planes.filtered_color[channel] + center, result);
+        }
+        __m128 result = _mm_or_ps(
+                _mm_and_ps(filtered, _mm_mul_ps(_mm_mul_ps(variance_sum, inv_weight_sum), inv_weight_sum)),
+                _mm_andnot_ps(filtered, _mm_loadu_ps(planes.variance + center)));
+        _mm_storeu_ps(planes.filtered_variance + center, result);
+    }
+
+    // AVX has no 8 wide integer operations, the exponent bits are added to each half
+    CG_TARGET_AVX inline __m256 exp2_weight_8_avx(__m256 x) {
+        x = _mm256_max_ps(x, _mm256_set1_ps(min_weight_exponent));
+        __m256i integer = _mm256_cvttps_epi32(x);
+        __m256 f = _mm256_sub_ps(x, _mm256_cvtepi32_ps(integer));
+        __m256 p = _mm256_add_ps(_mm256_set1_ps(0.009618129f), _mm256_mul_ps(f, _mm256_set1_ps(0.001333356f)));
+        p = _mm256_add_ps(_mm256_set1_ps(0.05550411f), _mm256_mul_ps(f, p));
+        p = _mm256_add_ps(_mm256_set1_ps(0.2402265f), _mm256_mul_ps(f, p));
+        p = _mm256_add_ps(_mm256_set1_ps(0.6931472f), _mm256_mul_ps(f, p));
+        p = _mm256_add_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(f, p));
+        __m256i bits = _mm256_castps_si256(p);
+        __m128i low = _mm_add_epi32(_mm256_castsi256_si128(bits),
+                                    _mm_slli_epi32(_mm256_castsi256_si128(integer), 23));
+        __m128i high = _mm_add_epi32(_mm256_extractf128_si256(bits, 1),
+                                     _mm_slli_epi32(_mm256_extractf128_si256(integer, 1), 23));
+        return _mm256_castsi256_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(low), high, 1));
+    }
+
+    CG_TARGET_AVX inline void atrous_denoiser::filter_pixels_8_avx(const pass_planes &planes, int x, int y) const {
+        int center = y * width + x;
+        __m256 zero = _mm256_setzero_ps();
+        __m256 sign = _mm256_set1_ps(-0.0f);
+        __m256 center_depth = _mm256_loadu_ps(&depth_plane[center]);
+        __m256 center_color[3];
+        __m256 center_normal[3];
+        __m256 center_albedo[3];
+        for (int channel = 0; channel < 3; ++channel) {
+            center_color[channel] = _mm256_loadu_ps(planes.color[channel] + center);
+            center_normal[channel] = _mm256_loadu_ps(&normal_planes[channel][center]);
+            center_albedo[channel] = _mm256_loadu_ps(&albedo_planes[channel][center]);
+        }
+        __m256 center_luminance = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f), center_color[0]),
+                              _mm256_mul_ps(_mm256_set1_ps(0.7152f), center_color[1])),
+                _mm256_mul_ps(_mm256_set1_ps(0.0722f), center_color[2]));
+        __m256 luminance_scale = _mm256_loadu_ps(&inv_luminance_scale[center]);
+        __m256 depth_scale = _mm256_loadu_ps(&inv_depth_scale[center]);
+        __m256 albedo_scale = _mm256_set1_ps(1.0f / (sigma_albedo * sigma_albedo));
+        __m256 weight_sum = zero;
+        __m256 sum[3] = {zero, zero, zero};
+        __m256 variance_sum = zero;
+        for (int tap = 0; tap < 25; ++tap) {
+            int neighbour_y = y + planes.offset_y[tap];
+            if (neighbour_y < 0 || neighbour_y >= height) {
+                continue;
+            }
+            int neighbour = neighbour_y * width + x + planes.offset_x[tap];
+            __m256 cosine = _mm256_add_ps(
+                    _mm256_add_ps(_mm256_mul_ps(center_normal[0], _mm256_loadu_ps(&normal_planes[0][neighbour])),
+                                  _mm256_mul_ps(center_normal[1], _mm256_loadu_ps(&normal_planes[1][neighbour]))),
+                    _mm256_mul_ps(center_normal[2], _mm256_loadu_ps(&normal_planes[2][neighbour])));
+            __m256 normal_weight = _mm256_max_ps(cosine, zero);
+            for (int square = 0; square < 7; ++square) {
+                normal_weight = _mm256_mul_ps(normal_weight, normal_weight);
+            }
+            __m256 color_r = _mm256_loadu_ps(planes.color[0] + neighbour);
+            __m256 color_g = _mm256_loadu_ps(planes.color[1] + neighbour);
+            __m256 color_b = _mm256_loadu_ps(planes.color[2] + neighbour);
+            __m256 luminance = _mm256_add_ps(
+                    _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f), color_r),
+                                  _mm256_mul_ps(_mm256_set1_ps(0.7152f), color_g)),
+                    _mm256_mul_ps(_mm256_set1_ps(0.0722f), color_b));
+            __m256 luminance_distance = _mm256_mul_ps(
+                    _mm256_andnot_ps(sign, _mm256_sub_ps(center_luminance, luminance)), luminance_scale);
+            __m256 depth = _mm256_loadu_ps(&depth_plane[neighbour]);
+            __m256 depth_distance = _mm256_mul_ps(
+                    _mm256_mul_ps(_mm256_andnot_ps(sign, _mm256_sub_ps(center_depth, depth)), depth_scale),
+                    _mm256_set1_ps(planes.inv_distance[tap]));
+            __m256 albedo_r = _mm256_sub_ps(center_albedo[0], _mm256_loadu_ps(&albedo_planes[0][neighbour]));
+            __m256 albedo_g = _mm256_sub_ps(center_albedo[1], _mm256_loadu_ps(&albedo_planes[1][neighbour]));
+            __m256 albedo_b = _mm256_sub_ps(center_albedo[2], _mm256_loadu_ps(&albedo_planes[2][neighbour]));
+            __m256 albedo_distance = _mm256_mul_ps(
+                    _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(albedo_r, albedo_r), _mm256_mul_ps(albedo_g, albedo_g)),
+                                  _mm256_mul_ps(albedo_b, albedo_b)),
+                    albedo_scale);
+            __m256 exponent = _mm256_mul_ps(
+                    _mm256_add_ps(_mm256_add_ps(luminance_distance, depth_distance), albedo_distance),
+                    _mm256_set1_ps(-1.442695f));
+            __m256 weight = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(planes.kernel[tap]), normal_weight),
+                                          exp2_weight_8_avx(exponent));
+            weight = _mm256_and_ps(weight, _mm256_cmp_ps(depth, zero, _CMP_GT_OQ));
+            weight_sum = _mm256_add_ps(weight_sum, weight);
+            sum[0] = _mm256_add_ps(sum[0], _mm256_mul_ps(weight, color_r));
+            sum[1] = _mm256_add_ps(sum[1], _mm256_mul_ps(weight, color_g));
+            sum[2] = _mm256_add_ps(sum[2], _mm256_mul_ps(weight, color_b));
+            variance_sum = _mm256_add_ps(
+                    variance_sum, _mm256_mul_ps(_mm256_mul_ps(weight, weight), _mm256_loadu_ps(planes.variance + neighbour)));
+        }
+        __m256 filtered = _mm256_and_ps(_mm256_cmp_ps(center_depth, zero, _CMP_GT_OQ),
+                                        _mm256_cmp_ps(weight_sum, zero, _CMP_GT_OQ));
+        __m256 inv_weight_sum = _mm256_and_ps(_mm256_div_ps(_mm256_set1_ps(1.0f), weight_sum), filtered);
+        for (int channel = 0; channel < 3; ++channel) {
+            __m256 result = _mm256_blendv_ps(center_color[channel], _mm256_mul_ps(sum[channel], inv_weight_sum),
+                                             filtered);
+            _mm256_storeu_ps(planes.filtered_color[channel] + center, result);
+        }
+        __m256 result = _mm256_blendv_ps(_mm256_loadu_ps(planes.variance + center),
+                                         _mm256_mul_ps(_mm256_mul_ps(variance_sum, inv_weight_sum), inv_weight_sum),
+                                         filtered);
+        _mm256_storeu_ps(planes.filtered_variance + center, result);
+    }
+#endif
+}// namespace cg::renderer
@@ -1,17 +1,36 @@
 #pragma once
 
+#include "renderer/raytracer/alias_table.h"
+#include "renderer/raytracer/denoiser.h"
+#include "renderer/raytracer/sampler.h"
+#include "renderer/raytracer/simd.h"
+#include "renderer/raytracer/tonemap.h"
 #include "resource.h"
+#include "utils/error_handler.h"
+#include "utils/mapped_file.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <linalg.h>
 #include <memory>
+#include <numeric>
 #include <omp.h>
-#include <random>
+#include <type_traits>
+#include <utility>
 
 using namespace linalg::aliases;
 
 namespace cg::renderer {
     struct ray {
+        ray() = default;
+
         ray(float3 position, float3 direction) : position(position) {
             this->direction = normalize(direction);
         }
@@ -24,10 +43,13 @@ namespace cg::renderer {
         float t;
         float3 bary;
         cg::color color;
+        // Solid angle pdf the bounce shader sampled the ray with, 0 for camera rays
+        float ray_pdf = 0.0f;
     };
 
     template<typename VB>
     struct triangle {
+        triangle() = default;
         triangle(const VB &vertex_a, const VB &vertex_b, const VB &vertex_c);
 
         float3 a;
@@ -65,17 +87,322 @@ namespace cg::renderer {
     template<typename VB>
     class aabb {
     public:
-        void add_triangle(const triangle<VB> triangle);
+        void add_point(const float3 &point);
+
+        void add_triangle(const triangle<VB> &triangle);
+
+        void add_aabb(const aabb<VB> &other);
+
+        aabb<VB> transform(const float4x4 &matrix) const;
+
+        float3 get_center() const;
+
+        float get_surface_area() const;
+
+        int get_largest_axis() const;
+
+        const float3 &get_min() const;
 
-        const std::vector<triangle<VB>> &get_triangles() const;
+        const float3 &get_max() const;
 
-        bool aabb_test(const ray &ray) const;
+        bool aabb_test(const ray &ray, const float3 &inv_ray_direction, float max_t, float &t_near) const;
 
     protected:
-        std::vector<triangle<VB>> triangles;
+        float3 aabb_min{FLT_MAX, FLT_MAX, FLT_MAX};
+        float3 aabb_max{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    };
+
+    // Nodes are stored depth-first: the left child always follows its parent, offset holds the right child
+    // of an interior node or the first primitive of a leaf
+    template<typename VB>
+    struct alignas(32) bvh_node {
+        aabb<VB> bounds;
+        unsigned int offset = 0;
+        unsigned int primitive_count = 0;
+    };
+
+    template<typename VB>
+    class bvh;
+
+    // Bounds of N children in SoA form, so one SIMD slab test covers the whole node.
+    // child holds a wide node index for interior children or the first primitive of a leaf child.
+    // Unused slots keep a degenerate box at FLT_MAX that no ray can reach.
+    template<typename VB, unsigned int N>
+    struct alignas(64) wide_bvh_node {
+        float min_x[N];
+        float min_y[N];
+        float min_z[N];
+        float max_x[N];
+        float max_y[N];
+        float max_z[N];
+        unsigned int child[N];
+        unsigned int primitive_count[N];
+
+        unsigned int intersect(const ray &ray, const float3 &inv_ray_direction, float max_t, float *t_near) const;
+    };
+
+    // N-wide BVH collapsed from a binary SAH tree, nodes are stored depth-first
+    template<typename VB, unsigned int N>
+    class wide_bvh {
+    public:
+        void build(const bvh<VB> &binary);
+
+        const std::vector<wide_bvh_node<VB, N>> &get_nodes() const;
+
+    protected:
+        unsigned int collapse_node(const std::vector<bvh_node<VB>> &binary_nodes, unsigned int binary_node_id);
+
+        std::vector<wide_bvh_node<VB, N>> nodes;
+    };
+
+    // Binary bounding volume hierarchy over primitive bounds, split with the binned surface area heuristic.
+    // Leaves reference contiguous ranges of primitive_indices. With a width of 4 or 8 the tree is also
+    // collapsed into a wide BVH, which is then used for traversal.
+    // The top splits are binned with parallel reductions, the subtrees below them are built in parallel.
+    template<typename VB>
+    class bvh {
+    public:
+        static constexpr unsigned int max_depth = 64;
+        static constexpr unsigned int invalid_primitive = ~0u;
+
+        void build(const std::vector<aabb<VB>> &primitive_bounds);
+
+        void refit(const std::vector<aabb<VB>> &primitive_bounds);
+
+        void set_width(unsigned int in_width);
+
+        unsigned int get_width() const;
+
+        // Leaf ranges start at multiples of the alignment, padding slots hold invalid_primitive. The SAH then
+        // prices leaves per started block of primitives, and a leaf may hold up to two blocks
+        void set_leaf_alignment(unsigned int in_leaf_alignment);
+
+        const std::vector<bvh_node<VB>> &get_nodes() const;
+
+        const wide_bvh<VB, 4> &get_bvh4() const;
+
+        const wide_bvh<VB, 8> &get_bvh8() const;
+
+        const std::vector<unsigned int> &get_primitive_indices() const;
+
+        float get_sah_cost(const std::vector<float> &primitive_costs = {}) const;
+
+        // SAH cost right after the last build, refits are compared against it to detect degraded trees
+        float get_build_sah_cost() const;
+
+        bool is_degraded(float rebuild_threshold) const;
+
+        void save(std::ostream &stream) const;
+
+        bool load(const char *&data, const char *end);
+
+        // Cached trees are only valid for the same builder settings
+        static uint64_t get_build_parameters_hash();
+
+    protected:
+        struct build_input {
+            const std::vector<aabb<VB>> &primitive_bounds;
+            std::vector<float3> centroids;
+        };
+
+        struct subtree {
+            unsigned int first;
+            unsigned int count;
+            unsigned int depth;
+            std::vector<bvh_node<VB>> nodes;
+        };
+
+        struct bin {
+            aabb<VB> bounds;
+            unsigned int count = 0;
+        };
+
+        void build_wide();
+
+        void align_leaves();
+
+        float get_leaf_cost(unsigned int count) const;
+
+        unsigned int get_max_leaf_size() const;
+
+        unsigned int build_top_node(std::vector<bvh_node<VB>> &top_nodes, std::vector<int> &top_subtrees,
+                                    std::vector<subtree> &subtrees, unsigned int first, unsigned int count,
+                                    unsigned int depth, unsigned int subtree_size, const build_input &input);
+
+        unsigned int build_node(std::vector<bvh_node<VB>> &out_nodes, unsigned int first, unsigned int count,
+                                unsigned int depth, const build_input &input);
+
+        // Serial ranges skip the OpenMP region entirely, its setup costs more than binning a small node
+        template<typename F>
+        static void for_each_primitive(unsigned int first, unsigned int count, bool parallel, F body);
+
+        void compute_bounds(unsigned int first, unsigned int count, const build_input &input, bool parallel,
+                            aabb<VB> &bounds, aabb<VB> &centroid_bounds) const;
+
+        unsigned int split_node(unsigned int first, unsigned int count, unsigned int depth, const aabb<VB> &bounds,
+                                const aabb<VB> &centroid_bounds, const build_input &input, bool parallel);
+
+        std::vector<bvh_node<VB>> nodes;
+        std::vector<unsigned int> primitive_indices;
+
+        unsigned int width = 2;
+        unsigned int leaf_alignment = 1;
+        wide_bvh<VB, 4> bvh4;
+        wide_bvh<VB, 8> bvh8;
+        float build_sah_cost = 0.0f;
+
+        static constexpr unsigned int max_leaf_size = 4;
+        static constexpr unsigned int max_bin_count = 32;
+        static constexpr unsigned int min_subtree_size = 1024;
+        static constexpr float traversal_cost = 1.0f;
+        static constexpr float intersection_cost = 1.0f;
+
+        static_assert(sizeof(bvh_node<VB>) == 32, "BVH node has to fit half of a cache line");
+    };
+
+    // Hot triangle data of one BVH leaf in SoA layout: only what the intersection test reads.
+    // Unused lanes stay zeroed, degenerate triangles are never hit.
+    struct alignas(16) triangle_packet {
+        static constexpr unsigned int width = 4;
+
+        float a[3][width];
+        float ba[3][width];
+        float ca[3][width];
+    };
 
-        float3 aabb_min;
-        float3 aabb_max;
+    // Cold triangle data, only read for the closest hit
+    struct triangle_shading {
+        float3 b;
+        float3 c;
+        float3 na;
+        float3 nb;
+        float3 nc;
+        float3 ambient;
+        float3 diffuse;
+        float3 emissive;
+    };
+
+    // Bottom-level structure: a BVH over the triangles of one mesh in object space.
+    // Positions are packed per leaf in BVH order, so leaves index them directly. The shading data uses the
+    // same slots and is only fetched once the closest triangle is known.
+    template<typename VB>
+    class blas {
+    public:
+        void build(std::vector<triangle<VB>> in_triangles, unsigned int bvh_width = 2);
+
+        // Triangles are expected in the original order. Returns true when the mesh had to be rebuilt
+        bool refit(std::vector<triangle<VB>> in_triangles, float rebuild_threshold);
+
+        void set_bvh_width(unsigned int in_width);
+
+        const bvh<VB> &get_bvh() const;
+
+        const std::vector<triangle_packet> &get_packets() const;
+
+        size_t get_triangle_count() const;
+
+        // Takes a BVH ordered slot, like the leaf ranges
+        triangle<VB> get_triangle(unsigned int slot) const;
+
+        // Starts loading the shading data of a candidate hit while the traversal goes on
+        void prefetch_shading(unsigned int slot) const;
+
+        aabb<VB> get_bounds() const;
+
+        void save(std::ostream &stream) const;
+
+        bool load(const char *&data, const char *end);
+
+    protected:
+        static std::vector<aabb<VB>> get_triangle_bounds(const std::vector<triangle<VB>> &in_triangles);
+
+        void set_triangles(const std::vector<triangle<VB>> &in_triangles);
+
+        bvh<VB> tree;
+        std::vector<triangle_packet> packets;
+        std::vector<triangle_shading> shading;
+        size_t triangle_count = 0;
+    };
+
+    template<typename VB>
+    struct instance {
+        unsigned int mesh_id;
+        float4x4 world_matrix;
+        float4x4 inverse_world_matrix;
+
+        triangle<VB> to_world(const triangle<VB> &triangle) const;
+    };
+
+    // Top-level structure: a BVH over transformed instances of the bottom-level meshes.
+    // Moving an instance only refits the top level, the meshes themselves are never copied.
+    template<typename VB>
+    class tlas {
+    public:
+        void set_mesh(unsigned int mesh_id, std::vector<triangle<VB>> in_triangles);
+
+        bool refit_mesh(unsigned int mesh_id, std::vector<triangle<VB>> in_triangles);
+
+        unsigned int add_instance(unsigned int mesh_id, const float4x4 &world_matrix);
+
+        void set_instance_transform(unsigned int instance_id, const float4x4 &world_matrix);
+
+        void build();
+
+        void refit();
+
+        void set_bvh_width(unsigned int in_width);
+
+        // Refitted levels are rebuilt once their SAH cost grows past this factor of the built cost
+        void set_rebuild_threshold(float in_rebuild_threshold);
+
+        float get_sah_cost() const;
+
+        const bvh<VB> &get_bvh() const;
+
+        const std::vector<blas<VB>> &get_meshes() const;
+
+        const std::vector<instance<VB>> &get_instances() const;
+
+        // The meshes are cached on disk under a key of the source content, instances are not stored
+        bool save_meshes(const std::filesystem::path &cache_path, uint64_t content_key) const;
+
+        bool load_meshes(const std::filesystem::path &cache_path, uint64_t content_key);
+
+    protected:
+        static uint64_t get_cache_key(uint64_t content_key);
+
+        std::vector<aabb<VB>> get_instance_bounds() const;
+
+        bvh<VB> tree;
+        std::vector<blas<VB>> meshes;
+        std::vector<instance<VB>> instances;
+        unsigned int bvh_width = 2;
+        float rebuild_threshold = 1.5f;
+    };
+
+    struct alignas(64) ray_statistics {
+        size_t rays = 0;
+        size_t visited_nodes = 0;
+        // Seconds a thread spent rendering tiles
+        double busy_time = 0.0;
+    };
+
+    // Running mean and sum of squared deviations (Welford) of the luminance of the samples of one pixel
+    struct pixel_variance {
+        void add(float value);
+
+        // Combines the samples of both, as if they were added to one (Chan et al.)
+        void merge(const pixel_variance &other);
+
+        // Standard error of the mean relative to the mean
+        float get_relative_error() const;
+
+        // Variance of the mean. Below 2 samples it is unknown and taken as the squared mean
+        float get_mean_variance() const;
+
+        float mean = 0.0f;
+        float m2 = 0.0f;
+        unsigned int samples = 0;
     };
 
     struct light {
@@ -83,11 +410,170 @@ namespace cg::renderer {
         float3 color;
     };
 
-    template<typename VB, typename RT>
-    class raytracer {
+    inline float luminance(const float3 &color) {
+        return dot(color, float3{0.2126f, 0.7152f, 0.0722f});
+    }
+
+    // Rays leaving one origin in SoA layout, tested 4 at a time against one box or one triangle.
+    // The count is padded to whole groups with rays that can not hit anything.
+    struct ray_packet {
+        static constexpr unsigned int max_size = 64;
+        static constexpr unsigned int group_size = 4;
+
+        void set_ray(unsigned int i, const float3 &direction, float min_t, float max_t);
+
+        void set_count(unsigned int in_count);
+
+        // Mask of the rays of a group entering the box before their max_t
+        unsigned int intersect_box(unsigned int first, const float3 &box_min, const float3 &box_max) const;
+
+        // Records the triangle for the rays hitting it closer than their max_t, bit i of group_mask enables
+        // the group of rays starting at i * group_size
+        void intersect_triangle(unsigned int group_mask, const float3 &a, const float3 &ba, const float3 &ca,
+                                int triangle);
+
+        float get_max_t() const;
+
+        unsigned int count = 0;
+        float3 origin;
+        alignas(16) float direction[3][max_size];
+        alignas(16) float inv_direction[3][max_size];
+        alignas(16) float min_t[max_size];
+        alignas(16) float max_t[max_size];
+        alignas(16) float u[max_size];
+        alignas(16) float v[max_size];
+        alignas(16) int triangle[max_size];
+    };
+
+    // Bounds the directions of a ray packet. Axes with negative directions are mirrored, so the test
+    // against a box only needs the inverse direction range of every axis.
+    struct ray_frustum {
+        // Returns false when the rays diverge: mixed direction signs or axis-parallel rays
+        bool init(const ray_packet &packet);
+
+        // Conservative: a box missed by the frustum is missed by every ray of the packet
+        template<typename VB>
+        bool intersect(const aabb<VB> &box, float max_t, float &t_near) const;
+
+        float3 origin;
+        float3 sign;
+        float3 inv_min;
+        float3 inv_max;
+    };
+
+    // Rays of one wavefront bounce in SoA layout. Every ray carries the pixel it contributes to and the weight
+    // of its path up to the ray origin
+    struct ray_queue {
+        void clear();
+
+        void push(const ray &ray, unsigned int pixel, const float3 &weight, float pdf, const sampler &sampler);
+
+        size_t size() const;
+
+        ray get_ray(size_t i) const;
+
+        float3 get_weight(size_t i) const;
+
+        // Reorders the rays by direction octant and by the cell of their origin on a Morton curve, so rays next
+        // to each other in the queue traverse the same BVH nodes
+        void sort(const float3 &scene_min, const float3 &scene_max);
+
+        std::vector<float> position[3];
+        std::vector<float> direction[3];
+        std::vector<float> weight[3];
+        std::vector<unsigned int> pixel;
+        std::vector<float> pdf;
+        // Where the path of the ray is in the sample dimensions of its pixel
+        std::vector<sampler> samplers;
+    };
+
+    // Stable LSD radix sort, returns the indices of the keys in ascending key order. Only the low key_bits
+    // of the keys are sorted on
+    std::vector<unsigned int> sort_by_key(const std::vector<uint32_t> &keys, unsigned int key_bits);
+
+    // Interleaves the bits of x and y, used to order the image tiles
+    uint64_t morton_code_2d(uint32_t x, uint32_t y);
+
+    // Result of the bounce shader for one hit: the light sent back along the ray and the next ray of the
+    // path, whose light is scaled by next_weight. A zero next_weight ends the path. next_pdf reaches the next
+    // hit as payload::ray_pdf
+    struct bounce {
+        float3 color{0.0f};
+        ray next_ray{float3{0.0f}, float3{0.0f, 0.0f, 1.0f}};
+        float3 next_weight{0.0f};
+        float next_pdf = 0.0f;
+    };
+
+    // Point on an emissive triangle picked by raytracer::sample_light, pdf is per unit area over all the lights
+    template<typename VB>
+    struct light_sample {
+        float3 position{0.0f};
+        const triangle<VB> *emitter = nullptr;
+        float pdf = 0.0f;
+    };
+
+    // Placeholder for a shader left out of a compile time shader binding
+    struct no_shader {};
+
+    // Runtime shader binding, every shader call is an indirect call through std::function
+    template<typename VB>
+    struct function_shaders {
+        std::function<payload( const ray
+        &ray)>
+        miss_shader;
+        std::function<payload( const ray
+        &ray,
+        payload &payload,
+        const triangle<VB> &triangle, size_t
+        depth)>
+        closest_hit_shader = nullptr;
+        std::function<payload(const ray & ray, payload & payload, const triangle<VB>
+        &triangle)>
+        any_hit_shader = nullptr;
+        // When set, paths are traced in a loop carrying their weight instead of recursing from the closest hit
+        // shader, and the closest hit shader is not called. Not used together with an any hit shader
+        std::function<bounce(const ray &ray, payload &payload, const triangle<VB> &triangle, size_t depth)>
+        bounce_shader = nullptr;
+    };
+
+    // Compile time shader binding: the shader types are template parameters, so the calls are inlined into
+    // traversal. Shaders may take the raytracer as their first argument to trace further rays
+    template<typename MISS, typename CLOSEST_HIT, typename ANY_HIT = no_shader, typename BOUNCE = no_shader>
+    struct static_shaders {
+        MISS miss_shader;
+        CLOSEST_HIT closest_hit_shader;
+        ANY_HIT any_hit_shader = {};
+        BOUNCE bounce_shader = {};
+    };
+
+    template<typename MISS, typename CLOSEST_HIT>
+    static_shaders<MISS, CLOSEST_HIT> make_static_shaders(MISS miss_shader, CLOSEST_HIT closest_hit_shader) {
+        return {std::move(miss_shader), std::move(closest_hit_shader)};
+    }
+
+    // Empty std::function shaders and no_shader are not set, any other callable is
+    template<typename SHADER>
+    constexpr bool has_shader(const SHADER &) {
+        return true;
+    }
+
+    template<typename SIGNATURE>
+    inline bool has_shader(const std::function<SIGNATURE> &shader) {
+        return static_cast<bool>(shader);
+    }
+
+    constexpr bool has_shader(const no_shader &) {
+        return false;
+    }
+
+    // The shaders are members of SHADERS, function_shaders keeps them assignable at runtime
+    template<typename VB, typename RT, typename SHADERS = function_shaders<VB>>
+    class raytracer : public SHADERS {
     public:
         raytracer() {};
 
+        explicit raytracer(SHADERS in_shaders) : SHADERS(std::move(in_shaders)) {}
+
         ~raytracer() {};
 
         void set_render_target(std::shared_ptr<resource<RT>> in_render_target);
@@ -102,160 +588,1486 @@ namespace cg::renderer {
 
         void build_acceleration_structure();
 
-        std::vector<aabb<VB>> acceleration_structures;
+        // Updates the acceleration structure after the vertex buffers were modified in place
+        void refit();
+
+        unsigned int add_instance(unsigned int mesh_id, const float4x4 &world_matrix);
+
+        void set_instance_transform(unsigned int instance_id, const float4x4 &world_matrix);
+
+        void set_bvh_width(unsigned int in_width);
+
+        // Camera rays are traced in packets of size x size pixels, 1 traces every ray on its own
+        void set_packet_size(unsigned int in_packet_size);
+
+        // The image is rendered in square tiles of tile_size pixels, handed out to threads in Morton order
+        void set_tile_size(unsigned int in_tile_size);
+
+        void set_sampler_type(sampler_type in_sampler_type);
+
+        // Sampler of the pixel sample the calling thread is shading, the pixel offset took its first two
+        // dimensions. Shaders draw their random numbers from it
+        sampler &get_sampler() const;
+
+        // Adaptive sampling: after min_adaptive_samples, a tile gets no more samples once the relative error of
+        // all its pixels is below target_error. 0 samples every pixel accumulation_num times
+        void set_target_error(float in_target_error);
+
+        // With a bounce shader, traces the paths in waves, one bounce of a batch of pixels at a time
+        void set_wavefront(bool in_wavefront);
+
+        // Paths past this many bounces continue with a probability of their largest weight component, and are
+        // weighted up to make up for the ones stopped
+        void set_russian_roulette_depth(unsigned int in_russian_roulette_depth);
+
+        // Wall clock seconds ray_generation may take, 0 for no limit. Past the first frame, no more tiles are
+        // started once it is used up, so the last frame may only cover part of the image. Pixels are averaged
+        // over their own number of samples, so partly covered frames need no special treatment
+        void set_time_budget(double in_time_budget);
+
+        // Exposure in stops and operator resolve maps the linear radiance to 8 bit render targets with
+        void set_tonemap(tonemap_operator in_tonemap_operator, float in_exposure);
+
+        // resolve filters the radiance with atrous_denoiser. It is guided by the first hits of aov_samples camera
+        // rays per pixel, which ray_generation traces before the frames
+        void set_denoise(bool in_denoise);
+
+        // Samples taken over all pixels by the last ray_generation
+        size_t get_sample_count() const;
+
+        // ray_generation writes the accumulated samples to checkpoint_path every checkpoint_interval seconds and
+        // when it is done. The file is written by a background thread while the next frames are traced, an
+        // empty path writes no checkpoints
+        void set_checkpoint(const std::filesystem::path &in_checkpoint_path, double in_checkpoint_interval);
+
+        // Sample index of the first frame. Renders of one view given disjoint ranges of sample indices, e.g. on
+        // several machines, are combined by loading all their checkpoints
+        void set_first_sample(uint32_t in_first_sample);
+
+        // Adds the samples of a checkpoint to the accumulated ones, ray_generation then only traces the frames
+        // missing to accumulation_num. False when the file is missing, damaged or of another viewport size
+        bool load_checkpoint(const std::filesystem::path &path);
+
+        // Raytracers sharing one acceleration structure trace the same geometry without copying it
+        void set_acceleration_structure(std::shared_ptr<tlas<VB>> in_acceleration_structure);
+
+        const std::shared_ptr<tlas<VB>> &get_acceleration_structure() const;
+
+        // Triangles with nonzero emission in world space, gathered whenever the acceleration structure is built,
+        // refit or set
+        const std::vector<triangle<VB>> &get_emissive_triangles() const;
+
+        // Picks an emissive triangle in constant time with a probability proportional to its area times its
+        // emitted luminance, then a uniform point on it. An empty sample when the scene has no emission
+        light_sample<VB> sample_light(float u_light, const float2 &u_point) const;
+
+        // Density per unit area of sample_light picking a point on this emissive triangle
+        float get_light_pdf(const triangle<VB> &emitter) const;
 
         void ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth,
                             size_t accumulation_num);
 
+        // Averages the accumulated samples of every pixel into the radiance, denoises it when set to and writes it
+        // to the render target, tonemapped to sRGB for 8 bit targets. Called by ray_generation, call again after
+        // a tonemap change
+        void resolve();
+
+        // Linear mean radiance of every pixel after resolve
+        const std::shared_ptr<cg::resource<float3>> &get_radiance() const;
+
         payload trace_ray(const ray &ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f) const;
 
+        // Traces coherent rays sharing one origin through the BVH together, nodes are culled for the whole
+        // packet with a frustum test. Divergent packets fall back to trace_ray per ray. The sampler of the
+        // calling thread is set to ray_samplers[i] before ray i is shaded, when they are given
+        void trace_packet(const ray *rays, unsigned int count, size_t depth, payload *payloads,
+                          float max_t = 1000.f, float min_t = 0.001f, const sampler *ray_samplers = nullptr) const;
+
+        // Shadow ray query: stops at the first triangle in (min_t, max_t), no shaders are called
+        bool occluded(const ray &ray, float max_t, float min_t = 0.001f) const;
+
         payload intersection_shader(const triangle<VB> &triangle, const ray &ray) const;
 
-        std::function<payload( const ray
-        &ray)>
-        miss_shader;
-        std::function<payload( const ray
-        &ray,
-        payload &payload,
-        const triangle<VB> &triangle, size_t
-        depth)>
-        closest_hit_shader = nullptr;
-        std::function<payload(const ray & ray, payload & payload, const triangle<VB>
-        &triangle)>
-        any_hit_shader = nullptr;
+        // Closest hit in (min_t, max_t) among count triangles packed from the first packet on, tested 8 or 4
+        // at a time depending on the instruction set. Returns the slot relative to the first packet and
+        // shrinks max_t, or returns -1
+        static int intersect_packets(const triangle_packet *packets, unsigned int count, const ray &ray,
+                                     float min_t, float &max_t, float3 &bary);
+
+        static bool intersect_packets_any(const triangle_packet *packets, unsigned int count, const ray &ray,
+                                          float min_t, float max_t);
+
+        static unsigned int intersect_triangle_batch(const triangle_packet *packets, unsigned int count,
+                                                     const ray &ray, float min_t, float max_t, float *t, float *u,
+                                                     float *v, unsigned int &lane_count);
+
+        // Offset of the camera ray in the pixel, in [-0.5, 0.5)
+        float2 get_jitter(sampler &pixel_sampler) const;
 
-        float2 get_jitter(int frame_id);
+        ray_statistics get_ray_statistics() const;
+
+        // One entry per thread, to compare the load of the threads
+        const std::vector<ray_statistics> &get_thread_statistics() const;
+
+        void reset_ray_statistics();
+
+        static constexpr unsigned int max_packet_size = 8;
+        static constexpr int wavefront_batch_size = 1 << 18;
+        static constexpr unsigned int min_adaptive_samples = 8;
+        static constexpr uint32_t checkpoint_magic = 0x50434743;
+        static constexpr uint32_t checkpoint_version = 1;
+        static constexpr unsigned int aov_samples = 4;
 
     protected:
+        // Returns RESULT{} for a shader left out with no_shader
+        template<typename RESULT, typename SHADER, typename... ARGS>
+        RESULT call_shader(const SHADER &shader, ARGS &&...args) const;
+
+        // Closest hit of one ray so far, t is in world space
+        struct hit {
+            float t;
+            float3 bary;
+            unsigned int triangle = 0;
+            const cg::renderer::instance<VB> *instance = nullptr;
+        };
+
+        // Traverses the TLAS without calling shaders, returns true when the any hit shader terminates the ray
+        bool find_closest_hit(const ray &ray, float max_t, float min_t, hit &closest) const;
+
+        // Returns true when the any hit shader terminates the ray
+        bool intersect_instance(const instance<VB> &instance, const ray &ray, float min_t, hit &closest,
+                                unsigned int &visited_nodes) const;
+
+        void intersect_instance_packet(const instance<VB> &instance, const ray *rays, ray_packet &packet,
+                                       hit *closest, unsigned int &visited_nodes) const;
+
+        payload shade(const ray &ray, size_t depth, const hit &closest, bool terminated) const;
+
+        // Follows a path from its first hit with the bounce shader, without recursion
+        payload trace_path(const ray &first_ray, size_t depth, const hit &first_hit) const;
+
+        // Returns false for a path that stops at this bounce, otherwise scales up weight when it was at risk
+        bool survives_russian_roulette(size_t bounce_id, float3 &weight, sampler &path_sampler) const;
+
+        triangle<VB> get_world_triangle(const hit &closest) const;
+
+        void build_light_list();
+
+        // Tile coordinates along a Morton curve, neighbouring tiles are rendered close in time
+        std::vector<uint2> get_tile_order() const;
+
+        float3 get_ray_direction(int x, int y, const float2 &jitter, const float3 &direction, const float3 &right,
+                                 const float3 &up) const;
+
+        void accumulate(int x, int y, const float3 &color);
+
+        // Copy of the accumulation owned by the thread writing it
+        struct checkpoint {
+            uint32_t width;
+            uint32_t height;
+            uint32_t first_sample;
+            uint32_t frames;
+            std::vector<float3> history;
+            std::vector<pixel_variance> variance;
+        };
+
+        // Copies the accumulation and starts writing it, unless the last checkpoint is still being written
+        void start_checkpoint();
+
+        // Waits for the checkpoint being written
+        void finish_checkpoint();
+
+        // Written next to the target and renamed, a killed render leaves the previous checkpoint intact
+        static bool write_checkpoint(const std::filesystem::path &path, const checkpoint &snapshot);
+
+        // Traces one sample of every pixel of the tiles that are not converged, tile by tile. Tiles are only
+        // started before stop_time, returns false when some were left out
+        bool trace_tiles(const float3 &position, const float3 &direction, const float3 &right, const float3 &up,
+                         size_t depth, uint32_t sample_index, double stop_time);
+
+        size_t get_tile_index(int x, int y) const;
+
+        // Averages the shading normal facing the camera, the diffuse albedo and the distance of the first hits of
+        // the pixels, with the jitter of their first aov_samples samples. Pixels whose rays all miss get depth 0
+        void trace_aovs(const float3 &position, const float3 &direction, const float3 &right, const float3 &up);
+
+        // Marks the tiles whose pixels reached target_error. Returns the number of tiles still sampled
+        size_t update_converged_tiles();
+
+        // Generates the camera rays of a batch of pixels, then per bounce sorts the rays, traces them all and
+        // shades the hits grouped by mesh and triangle. Batches are only started when they are expected to be
+        // done by stop_time, they are too large to just stop starting them. Returns false when some were left out
+        bool trace_wavefront(const float3 &position, const float3 &direction, const float3 &right,
+                             const float3 &up, size_t depth, uint32_t sample_index, double stop_time);
+
         std::shared_ptr<cg::resource<RT>> render_target;
+        // Linear sum of the samples of every pixel, their count is in variance
         std::shared_ptr<cg::resource<float3>> history;
+        std::shared_ptr<cg::resource<float3>> radiance;
+        std::shared_ptr<cg::resource<pixel_variance>> variance;
+        // First hit features guiding the denoiser, only allocated with denoising on
+        std::shared_ptr<cg::resource<float3>> aov_normal;
+        std::shared_ptr<cg::resource<float3>> aov_albedo;
+        std::shared_ptr<cg::resource<float>> aov_depth;
         std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
         std::vector<std::shared_ptr<cg::resource<VB>>> vertex_buffers;
-        std::vector<triangle < VB>> triangles;
+        std::shared_ptr<tlas<VB>> acceleration_structure = std::make_shared<tlas<VB>>();
+        std::vector<triangle<VB>> emissive_triangles;
+        alias_table light_table;
 
         size_t width = 1920;
         size_t height = 1080;
+        unsigned int packet_size = 1;
+        unsigned int tile_size = 16;
+        float target_error = 0.0f;
+        bool wavefront = false;
+        unsigned int russian_roulette_depth = 3;
+        tonemap_operator output_tonemap_operator = tonemap_operator::clamp;
+        std::filesystem::path checkpoint_path;
+        double checkpoint_interval = 60.0;
+        double time_budget = 0.0;
+        // Time the last wavefront batch took
+        double wavefront_batch_time = 0.0;
+        double last_checkpoint_time = 0.0;
+        std::future<bool> checkpoint_writer;
+        uint32_t first_sample = 0;
+        // Frames in history, loaded checkpoints included
+        size_t accumulated_frames = 0;
+        float exposure = 0.0f;
+        bool denoise = false;
+        atrous_denoiser denoiser;
+        // In row major tile order, not in the order tiles are rendered
+        std::vector<uint8_t> converged_tiles;
+
+        mutable std::vector<ray_statistics> statistics = std::vector<ray_statistics>(omp_get_max_threads());
+
+        // Own cache line per thread
+        struct alignas(64) thread_sampler {
+            sampler value;
+        };
+        sampler_type pixel_sampler_type = sampler_type::sobol;
+        mutable std::vector<thread_sampler> samplers = std::vector<thread_sampler>(omp_get_max_threads());
+
+        std::vector<triangle<VB>> assemble_triangles(unsigned int shape) const;
+
+        template<typename LEAF>
+        bool traverse(const bvh<VB> &tree, const ray &ray, const float3 &inv_ray_direction,
+                      const float &max_t, unsigned int &visited_nodes, LEAF &&leaf) const;
+
+        template<typename LEAF>
+        bool traverse_binary(const bvh<VB> &tree, const ray &ray, const float3 &inv_ray_direction,
+                             const float &max_t, unsigned int &visited_nodes, LEAF &&leaf) const;
+
+        template<unsigned int N, typename LEAF>
+        bool traverse_wide(const wide_bvh<VB, N> &tree, const ray &ray, const float3 &inv_ray_direction,
+                           const float &max_t, unsigned int &visited_nodes, LEAF &&leaf) const;
+
+        // Nodes are entered when the frustum and at least one ray of the packet hit them. The leaf callback
+        // also gets the first group of rays that may hit the leaf and the leaf bounds
+        template<typename LEAF>
+        void traverse_packet(const bvh<VB> &tree, const ray_packet &packet, const ray_frustum &frustum,
+                             unsigned int &visited_nodes, LEAF &&leaf) const;
     };
 
-    template<typename VB, typename RT>
-    inline void raytracer<VB, RT>::set_render_target(
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_render_target(
             std::shared_ptr<resource<RT>> in_render_target) {
         render_target = in_render_target;
     }
 
-    template<typename VB, typename RT>
-    inline void raytracer<VB, RT>::set_viewport(size_t in_width,
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_viewport(size_t in_width,
                                                 size_t in_height) {
         width = in_width;
         height = in_height;
         history = std::make_shared<cg::resource<float3>>(width, height);
+        radiance = std::make_shared<cg::resource<float3>>(width, height);
+        variance = std::make_shared<cg::resource<pixel_variance>>(width, height);
     }
 
-    template<typename VB, typename RT>
-    inline void raytracer<VB, RT>::clear_render_target(
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::clear_render_target(
             const RT &in_clear_value) {
         for (int i = 0; i < render_target->get_number_of_elements(); ++i) {
             render_target->item(i) = in_clear_value;
             history->item(i) = {0, 0, 0};
+            radiance->item(i) = {0, 0, 0};
+            variance->item(i) = pixel_variance{};
         }
+        accumulated_frames = 0;
 
     }
 
-    template<typename VB, typename RT>
+    template<typename VB, typename RT, typename SHADERS>
     inline void
-    raytracer<VB, RT>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers) {
+    raytracer<VB, RT, SHADERS>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers) {
         vertex_buffers = in_vertex_buffers;
     }
 
-    template<typename VB, typename RT>
+    template<typename VB, typename RT, typename SHADERS>
     void
-    raytracer<VB, RT>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers) {
+    raytracer<VB, RT, SHADERS>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers) {
         index_buffers = in_index_buffers;
     }
 
-    template<typename VB, typename RT>
-    inline void raytracer<VB, RT>::build_acceleration_structure() {
-        for (int shape = 0; shape < index_buffers.size(); ++shape) {
-            auto &index_buffer = index_buffers[shape];
-            auto &vertex_buffer = vertex_buffers[shape];
-            size_t index_offset = 0;
-            aabb<VB> aabb;
-            while (index_offset < index_buffer->get_number_of_elements()) {
-                triangle<VB> tr(
-                        vertex_buffer->item(index_buffer->item(index_offset++)),
-                        vertex_buffer->item(index_buffer->item(index_offset++)),
-                        vertex_buffer->item(index_buffer->item(index_offset++))
-                );
-                triangles.push_back(tr);
-                aabb.add_triangle(tr);
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::build_acceleration_structure() {
+        for (unsigned int shape = 0; shape < index_buffers.size(); ++shape) {
+            if (shape < acceleration_structure->get_meshes().size()) {
+                continue;
+            }
+            acceleration_structure->set_mesh(shape, assemble_triangles(shape));
+        }
+        if (acceleration_structure->get_instances().empty()) {
+            for (unsigned int shape = 0; shape < index_buffers.size(); ++shape) {
+                acceleration_structure->add_instance(shape, linalg::identity);
             }
-            acceleration_structures.push_back(aabb);
         }
+        acceleration_structure->build();
+        build_light_list();
     }
 
-    template<typename VB, typename RT>
-    inline void raytracer<VB, RT>::ray_generation(
-            float3 position, float3 direction,
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::refit() {
+        for (unsigned int shape = 0; shape < index_buffers.size(); ++shape) {
+            acceleration_structure->refit_mesh(shape, assemble_triangles(shape));
+        }
+        if (acceleration_structure->get_instances().empty()) {
+            build_acceleration_structure();
+            return;
+        }
+        acceleration_structure->refit();
+        build_light_list();
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline std::vector<triangle<VB>> raytracer<VB, RT, SHADERS>::assemble_triangles(unsigned int shape) const {
+        auto &index_buffer = index_buffers[shape];
+        auto &vertex_buffer = vertex_buffers[shape];
+        std::vector<triangle<VB>> triangles;
+        triangles.reserve(index_buffer->get_number_of_elements() / 3);
+        for (size_t index_offset = 0; index_offset + 2 < index_buffer->get_number_of_elements(); index_offset += 3) {
+            triangles.emplace_back(
+                    vertex_buffer->item(index_buffer->item(index_offset)),
+                    vertex_buffer->item(index_buffer->item(index_offset + 1)),
+                    vertex_buffer->item(index_buffer->item(index_offset + 2))
+            );
+        }
+        return triangles;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline unsigned int raytracer<VB, RT, SHADERS>::add_instance(unsigned int mesh_id, const float4x4 &world_matrix) {
+        return acceleration_structure->add_instance(mesh_id, world_matrix);
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_instance_transform(unsigned int instance_id, const float4x4 &world_matrix) {
+        acceleration_structure->set_instance_transform(instance_id, world_matrix);
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_bvh_width(unsigned int in_width) {
+        acceleration_structure->set_bvh_width(in_width);
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_packet_size(unsigned int in_packet_size) {
+        if (in_packet_size < 1 || in_packet_size > max_packet_size) {
+            THROW_ERROR("Ray packet size has to be between 1 and 8");
+        }
+        packet_size = in_packet_size;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_tile_size(unsigned int in_tile_size) {
+        if (in_tile_size < 1) {
+            THROW_ERROR("Tile size has to be at least 1");
+        }
+        tile_size = in_tile_size;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_sampler_type(sampler_type in_sampler_type) {
+        pixel_sampler_type = in_sampler_type;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline sampler &raytracer<VB, RT, SHADERS>::get_sampler() const {
+        return samplers[omp_get_thread_num() % samplers.size()].value;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_target_error(float in_target_error) {
+        target_error = in_target_error;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_wavefront(bool in_wavefront) {
+        wavefront = in_wavefront;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_russian_roulette_depth(unsigned int in_russian_roulette_depth) {
+        russian_roulette_depth = in_russian_roulette_depth;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_time_budget(double in_time_budget) {
+        time_budget = in_time_budget;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_tonemap(tonemap_operator in_tonemap_operator, float in_exposure) {
+        output_tonemap_operator = in_tonemap_operator;
+        exposure = in_exposure;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_denoise(bool in_denoise) {
+        denoise = in_denoise;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline size_t raytracer<VB, RT, SHADERS>::get_sample_count() const {
+        size_t result = 0;
+        for (size_t i = 0; i < variance->get_number_of_elements(); ++i) {
+            result += variance->item(i).samples;
+        }
+        return result;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void
+    raytracer<VB, RT, SHADERS>::set_acceleration_structure(std::shared_ptr<tlas<VB>> in_acceleration_structure) {
+        acceleration_structure = in_acceleration_structure;
+        build_light_list();
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline const std::shared_ptr<tlas<VB>> &raytracer<VB, RT, SHADERS>::get_acceleration_structure() const {
+        return acceleration_structure;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline const std::vector<triangle<VB>> &raytracer<VB, RT, SHADERS>::get_emissive_triangles() const {
+        return emissive_triangles;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline light_sample<VB> raytracer<VB, RT, SHADERS>::sample_light(float u_light, const float2 &u_point) const {
+        light_sample<VB> result;
+        if (light_table.empty()) {
+            return result;
+        }
+        const auto &emitter = emissive_triangles[light_table.sample(u_light)];
+        // Square root warping keeps the points uniform over the triangle
+        float root = std::sqrt(u_point.x);
+        result.position = emitter.a + emitter.ba * (root * (1.0f - u_point.y)) + emitter.ca * (root * u_point.y);
+        result.emitter = &emitter;
+        result.pdf = get_light_pdf(emitter);
+        return result;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline float raytracer<VB, RT, SHADERS>::get_light_pdf(const triangle<VB> &emitter) const {
+        // The pick probability area * luminance / total over the area of the triangle
+        if (light_table.empty()) {
+            return 0.0f;
+        }
+        return luminance(emitter.emissive) / light_table.get_total_weight();
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::build_light_list() {
+        emissive_triangles.clear();
+        std::vector<float> weights;
+        const auto &meshes = acceleration_structure->get_meshes();
+        for (const auto &instance: acceleration_structure->get_instances()) {
+            const auto &mesh = meshes[instance.mesh_id];
+            // Leaves are padded to whole packets, so valid triangles can sit past get_triangle_count()
+            const auto &primitive_indices = mesh.get_bvh().get_primitive_indices();
+            for (unsigned int slot = 0; slot < primitive_indices.size(); ++slot) {
+                if (primitive_indices[slot] == bvh<VB>::invalid_primitive) {
+                    continue;
+                }
+                auto triangle = mesh.get_triangle(slot);
+                if (maxelem(triangle.emissive) <= 0.0f) {
+                    continue;
+                }
+                emissive_triangles.push_back(instance.to_world(triangle));
+                const auto &world_triangle = emissive_triangles.back();
+                float area = 0.5f * length(cross(world_triangle.ba, world_triangle.ca));
+                weights.push_back(area * luminance(world_triangle.emissive));
+            }
+        }
+        light_table = alias_table(weights);
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::ray_generation(
+            float3 position, float3 direction,
             float3 right, float3 up, size_t depth, size_t accumulation_num) {
-        float frame_weight = 1.0f / static_cast<float>(accumulation_num);
-        for (int frame_id = 0; frame_id < accumulation_num; ++frame_id) {
+        converged_tiles.assign(get_tile_order().size(), 0);
+        double start_time = omp_get_wtime();
+        double deadline = time_budget > 0.0 ? start_time + time_budget : DBL_MAX;
+        last_checkpoint_time = start_time;
+        if (denoise) {
+            trace_aovs(position, direction, right, up);
+        }
+        // Resumed renders go on from the frames they already have
+        size_t first_frame = accumulated_frames;
+        for (size_t frame_id = first_frame; frame_id < accumulation_num; ++frame_id) {
+            if (frame_id > first_frame && omp_get_wtime() >= deadline) {
+                std::cout << "Time budget used up after " << frame_id - first_frame << " frames" << std::endl;
+                break;
+            }
             std::cout << "Tracting frame #" << frame_id + 1 << std::endl;
-            float2 jitter = get_jitter(frame_id);
+            if (target_error > 0.0f && frame_id >= min_adaptive_samples && update_converged_tiles() == 0) {
+                std::cout << "All tiles converged" << std::endl;
+                break;
+            }
+            uint32_t sample_index = first_sample + static_cast<uint32_t>(frame_id);
+            // Every pixel gets at least one sample, whatever the budget
+            double stop_time = frame_id > first_frame ? deadline : DBL_MAX;
+            bool complete;
+            if (wavefront && has_shader(this->bounce_shader) && !has_shader(this->any_hit_shader)) {
+                complete = trace_wavefront(position, direction, right, up, depth, sample_index, stop_time);
+            } else {
+                complete = trace_tiles(position, direction, right, up, depth, sample_index, stop_time);
+            }
+            // A partial frame still used its sample index for some pixels, a resumed render has to go past it
+            accumulated_frames++;
+            if (!complete) {
+                std::cout << "Time budget used up in frame #" << frame_id + 1 << std::endl;
+                break;
+            }
+            if (!checkpoint_path.empty() && omp_get_wtime() - last_checkpoint_time >= checkpoint_interval) {
+                start_checkpoint();
+            }
+        }
+        // The last checkpoint holds the whole render, so it can be resumed for more samples later
+        if (!checkpoint_path.empty()) {
+            finish_checkpoint();
+            start_checkpoint();
+            finish_checkpoint();
+        }
+        resolve();
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_checkpoint(const std::filesystem::path &in_checkpoint_path,
+                                                           double in_checkpoint_interval) {
+        checkpoint_path = in_checkpoint_path;
+        checkpoint_interval = in_checkpoint_interval;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::set_first_sample(uint32_t in_first_sample) {
+        first_sample = in_first_sample;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::start_checkpoint() {
+        if (checkpoint_writer.valid() &&
+            checkpoint_writer.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return;
+        }
+        finish_checkpoint();
+        // Only the copy is made between the frames, the workers go on while the file is written
+        checkpoint snapshot;
+        snapshot.width = static_cast<uint32_t>(width);
+        snapshot.height = static_cast<uint32_t>(height);
+        snapshot.first_sample = first_sample;
+        snapshot.frames = static_cast<uint32_t>(accumulated_frames);
+        snapshot.history.assign(history->get_data(), history->get_data() + history->get_number_of_elements());
+        snapshot.variance.assign(variance->get_data(), variance->get_data() + variance->get_number_of_elements());
+        checkpoint_writer = std::async(std::launch::async, [path = checkpoint_path, snapshot = std::move(snapshot)] {
+            return write_checkpoint(path, snapshot);
+        });
+        last_checkpoint_time = omp_get_wtime();
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::finish_checkpoint() {
+        if (checkpoint_writer.valid() && !checkpoint_writer.get()) {
+            std::cout << "Can't write the checkpoint " << checkpoint_path << std::endl;
+        }
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline bool raytracer<VB, RT, SHADERS>::write_checkpoint(const std::filesystem::path &path,
+                                                            const checkpoint &snapshot) {
+        std::filesystem::path temporary_path = path;
+        temporary_path += ".tmp";
+        {
+            std::ofstream stream(temporary_path, std::ios::binary | std::ios::trunc);
+            if (!stream) {
+                return false;
+            }
+            uint32_t header[] = {checkpoint_magic, checkpoint_version, snapshot.width, snapshot.height,
+                                 snapshot.first_sample, snapshot.frames};
+            stream.write(reinterpret_cast<const char *>(header), sizeof(header));
+            stream.write(reinterpret_cast<const char *>(snapshot.history.data()),
+                         static_cast<std::streamsize>(snapshot.history.size() * sizeof(float3)));
+            stream.write(reinterpret_cast<const char *>(snapshot.variance.data()),
+                         static_cast<std::streamsize>(snapshot.variance.size() * sizeof(pixel_variance)));
+            if (!stream) {
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary_path, path, error);
+        if (error) {
+            std::filesystem::remove(temporary_path, error);
+            return false;
+        }
+        return true;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline bool raytracer<VB, RT, SHADERS>::load_checkpoint(const std::filesystem::path &path) {
+        cg::utils::mapped_file checkpoint_file(path);
+        uint32_t header[6];
+        size_t pixel_count = width * height;
+        if (!checkpoint_file.is_open() ||
+            checkpoint_file.get_size() != sizeof(header) + pixel_count * (sizeof(float3) + sizeof(pixel_variance))) {
+            return false;
+        }
+        const char *data = checkpoint_file.get_data();
+        std::memcpy(header, data, sizeof(header));
+        data += sizeof(header);
+        if (header[0] != checkpoint_magic || header[1] != checkpoint_version || header[2] != width ||
+            header[3] != height) {
+            return false;
+        }
+        for (size_t i = 0; i < pixel_count; ++i, data += sizeof(float3)) {
+            float3 pixel_history;
+            std::memcpy(&pixel_history, data, sizeof(float3));
+            history->item(i) += pixel_history;
+        }
+        for (size_t i = 0; i < pixel_count; ++i, data += sizeof(pixel_variance)) {
+            pixel_variance pixel_samples;
+            std::memcpy(&pixel_samples, data, sizeof(pixel_variance));
+            variance->item(i).merge(pixel_samples);
+        }
+        // Merged ranges of sample indices are expected to follow each other, new frames continue after them
+        first_sample = accumulated_frames == 0 ? header[4] : std::min(first_sample, header[4]);
+        accumulated_frames += header[5];
+        return true;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline bool raytracer<VB, RT, SHADERS>::trace_tiles(
+            const float3 &position, const float3 &direction, const float3 &right, const float3 &up, size_t depth,
+            uint32_t sample_index, double stop_time) {
+        std::vector<uint2> tiles = get_tile_order();
+        int tile_count = static_cast<int>(tiles.size());
+        size_t tiles_x = (width + tile_size - 1) / tile_size;
+        int skipped_tiles = 0;
+        // Tiles differ a lot in cost, so the threads take the next tile as they become free
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int tile_id = 0; tile_id < tile_count; ++tile_id) {
+            if (converged_tiles[tiles[tile_id].y * tiles_x + tiles[tile_id].x]) {
+                continue;
+            }
+            double tile_start = omp_get_wtime();
+            // The loop can't be left early, the tiles left over are skipped
+            if (tile_start >= stop_time) {
+#pragma omp atomic
+                skipped_tiles++;
+                continue;
+            }
+            int tile_x = static_cast<int>(tiles[tile_id].x * tile_size);
+            int tile_y = static_cast<int>(tiles[tile_id].y * tile_size);
+            int tile_end_x = std::min(tile_x + static_cast<int>(tile_size), static_cast<int>(width));
+            int tile_end_y = std::min(tile_y + static_cast<int>(tile_size), static_cast<int>(height));
+            // Packets go row by row over the tile, following the row major render target
+            for (int first_y = tile_y; first_y < tile_end_y; first_y += static_cast<int>(packet_size)) {
+                for (int first_x = tile_x; first_x < tile_end_x; first_x += static_cast<int>(packet_size)) {
+                    int last_x = std::min(first_x + static_cast<int>(packet_size), tile_end_x);
+                    int last_y = std::min(first_y + static_cast<int>(packet_size), tile_end_y);
+                    ray rays[max_packet_size * max_packet_size];
+                    unsigned int ray_count = 0;
+                    sampler ray_samplers[max_packet_size * max_packet_size];
+                    for (int y = first_y; y < last_y; ++y) {
+                        for (int x = first_x; x < last_x; ++x) {
+                            sampler &ray_sampler = ray_samplers[ray_count];
+                            ray_sampler.start(static_cast<uint32_t>(y * width + x), sample_index, pixel_sampler_type);
+                            float2 jitter = get_jitter(ray_sampler);
+                            rays[ray_count++] = ray(position, get_ray_direction(x, y, jitter, direction, right, up));
+                        }
+                    }
+                    payload payloads[max_packet_size * max_packet_size];
+                    trace_packet(rays, ray_count, depth, payloads, 1000.f, 0.001f, ray_samplers);
+                    unsigned int ray_id = 0;
+                    for (int y = first_y; y < last_y; ++y) {
+                        for (int x = first_x; x < last_x; ++x) {
+                            accumulate(x, y, payloads[ray_id++].color.to_float3());
+                        }
+                    }
+                }
+            }
+            statistics[omp_get_thread_num() % statistics.size()].busy_time += omp_get_wtime() - tile_start;
+        }
+        return skipped_tiles == 0;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::resolve() {
+        int pixel_count = static_cast<int>(history->get_number_of_elements());
+        // Pixels keep their own sample count, converged tiles stopped early
+#pragma omp parallel for
+        for (int i = 0; i < pixel_count; ++i) {
+            unsigned int samples = variance->item(i).samples;
+            radiance->item(i) = samples > 0 ? history->item(i) / static_cast<float>(samples) : float3{0.0f};
+        }
+        if (denoise && aov_depth) {
+            double denoise_start = omp_get_wtime();
+            std::vector<float> mean_variance(pixel_count);
+#pragma omp parallel for
+            for (int i = 0; i < pixel_count; ++i) {
+                mean_variance[i] = variance->item(i).get_mean_variance();
+            }
+            denoiser.denoise(&radiance->item(0), mean_variance.data(), &aov_normal->item(0), &aov_albedo->item(0),
+                             &aov_depth->item(0), &radiance->item(0), width, height);
+            std::cout << "Denoise time: " << static_cast<long long>((omp_get_wtime() - denoise_start) * 1000.0)
+                      << "ms" << std::endl;
+        }
+        if constexpr (std::is_same_v<RT, cg::unsigned_color>) {
+            static_assert(sizeof(float3) == 3 * sizeof(float) && sizeof(cg::unsigned_color) == 3,
+                          "Pixels are tonemapped as flat arrays of channels");
+            tonemap(&radiance->item(0).x, &render_target->item(0).r, 3 * static_cast<size_t>(pixel_count), exposure,
+                    output_tonemap_operator);
+        } else {
 #pragma omp parallel for
+            for (int i = 0; i < pixel_count; ++i) {
+                render_target->item(i) = RT::from_float3(radiance->item(i));
+            }
+        }
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline const std::shared_ptr<cg::resource<float3>> &raytracer<VB, RT, SHADERS>::get_radiance() const {
+        return radiance;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline std::vector<uint2> raytracer<VB, RT, SHADERS>::get_tile_order() const {
+        unsigned int tiles_x = static_cast<unsigned int>((width + tile_size - 1) / tile_size);
+        unsigned int tiles_y = static_cast<unsigned int>((height + tile_size - 1) / tile_size);
+        std::vector<std::pair<uint64_t, uint2>> keyed_tiles;
+        keyed_tiles.reserve(tiles_x * tiles_y);
+        for (unsigned int y = 0; y < tiles_y; ++y) {
+            for (unsigned int x = 0; x < tiles_x; ++x) {
+                keyed_tiles.emplace_back(morton_code_2d(x, y), uint2{x, y});
+            }
+        }
+        std::sort(keyed_tiles.begin(), keyed_tiles.end(), [](const auto &a, const auto &b) {
+            return a.first < b.first;
+        });
+        std::vector<uint2> tiles;
+        tiles.reserve(keyed_tiles.size());
+        for (const auto &keyed_tile: keyed_tiles) {
+            tiles.push_back(keyed_tile.second);
+        }
+        return tiles;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline float3 raytracer<VB, RT, SHADERS>::get_ray_direction(
+            int x, int y, const float2 &jitter, const float3 &direction, const float3 &right, const float3 &up) const {
+        float u = (2.0f * x + jitter.x) / static_cast<float>(width - 1) - 1.0f;
+        float v = (2.0f * y + jitter.y) / static_cast<float>(height - 1) - 1.0f;
+        u *= static_cast<float >(width) / static_cast<float>(height);
+        return direction + u * right - v * up;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::accumulate(int x, int y, const float3 &color) {
+        history->item(x, y) += color;
+        variance->item(x, y).add(luminance(color));
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::trace_aovs(
+            const float3 &position, const float3 &direction, const float3 &right, const float3 &up) {
+        if (!aov_depth || aov_depth->get_number_of_elements() != width * height) {
+            aov_normal = std::make_shared<cg::resource<float3>>(width, height);
+            aov_albedo = std::make_shared<cg::resource<float3>>(width, height);
+            aov_depth = std::make_shared<cg::resource<float>>(width, height);
+        }
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int y = 0; y < static_cast<int>(height); ++y) {
+            for (int x = 0; x < static_cast<int>(width); ++x) {
+                float3 normal{0.0f};
+                float3 albedo{0.0f};
+                float depth = 0.0f;
+                unsigned int hits = 0;
+                for (unsigned int sample = 0; sample < aov_samples; ++sample) {
+                    sampler ray_sampler;
+                    ray_sampler.start(static_cast<uint32_t>(y * width + x), first_sample + sample, pixel_sampler_type);
+                    float2 jitter = get_jitter(ray_sampler);
+                    ray camera_ray(position, get_ray_direction(x, y, jitter, direction, right, up));
+                    hit closest;
+                    find_closest_hit(camera_ray, 1000.f, 0.001f, closest);
+                    if (!closest.instance) {
+                        continue;
+                    }
+                    triangle<VB> world_triangle = get_world_triangle(closest);
+                    float3 hit_normal = normalize(closest.bary.x * world_triangle.na +
+                                                  closest.bary.y * world_triangle.nb +
+                                                  closest.bary.z * world_triangle.nc);
+                    normal += dot(hit_normal, camera_ray.direction) > 0.0f ? -hit_normal : hit_normal;
+                    albedo += world_triangle.diffuse;
+                    depth += closest.t;
+                    hits++;
+                }
+                if (hits > 0) {
+                    normal /= static_cast<float>(hits);
+                    albedo /= static_cast<float>(hits);
+                    depth /= static_cast<float>(hits);
+                }
+                aov_normal->item(x, y) = normal;
+                aov_albedo->item(x, y) = albedo;
+                aov_depth->item(x, y) = depth;
+            }
+        }
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline size_t raytracer<VB, RT, SHADERS>::get_tile_index(int x, int y) const {
+        size_t tiles_x = (width + tile_size - 1) / tile_size;
+        return y / tile_size * tiles_x + x / tile_size;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline size_t raytracer<VB, RT, SHADERS>::update_converged_tiles() {
+        int tiles_x = static_cast<int>((width + tile_size - 1) / tile_size);
+        int tile_count = static_cast<int>(converged_tiles.size());
+        size_t active_tiles = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+ : active_tiles)
+        for (int tile_id = 0; tile_id < tile_count; ++tile_id) {
+            if (converged_tiles[tile_id]) {
+                continue;
+            }
+            int tile_x = tile_id % tiles_x * static_cast<int>(tile_size);
+            int tile_y = tile_id / tiles_x * static_cast<int>(tile_size);
+            int tile_end_x = std::min(tile_x + static_cast<int>(tile_size), static_cast<int>(width));
+            int tile_end_y = std::min(tile_y + static_cast<int>(tile_size), static_cast<int>(height));
+            bool converged = true;
+            for (int y = tile_y; y < tile_end_y && converged; ++y) {
+                for (int x = tile_x; x < tile_end_x && converged; ++x) {
+                    converged = variance->item(x, y).get_relative_error() < target_error;
+                }
+            }
+            if (!converged) {
+                active_tiles++;
+                continue;
+            }
+            converged_tiles[tile_id] = 1;
+        }
+        return active_tiles;
+    }
 
-            for (int x = 0; x < width; ++x) {
-                for (int y = 0; y < height; ++y) {
-                    float u = (2.0f * x + jitter.x) / static_cast<float>(width - 1) - 1.0f;
-                    float v = (2.0f * y + jitter.y) / static_cast<float>(height - 1) - 1.0f;
-                    u *= static_cast<float >(width) / static_cast<float>(height);
-                    float3 ray_direction = direction + u * right - v * up;
-                    ray r(position, ray_direction);
-                    payload p = trace_ray(r, depth);
-                    auto &pixel_history = history->item(x, y);
-                    pixel_history += sqrt(float3{p.color.r, p.color.g, p.color.b} * frame_weight);
-                    if (frame_id == accumulation_num - 1) {
-                        render_target->item(x, y) = RT::from_float3(pixel_history);
+    template<typename VB, typename RT, typename SHADERS>
+    inline bool raytracer<VB, RT, SHADERS>::trace_wavefront(
+            const float3 &position, const float3 &direction, const float3 &right, const float3 &up, size_t depth,
+            uint32_t sample_index, double stop_time) {
+        const auto &nodes = acceleration_structure->get_bvh().get_nodes();
+        aabb<VB> scene_bounds = nodes.empty() ? aabb<VB>{} : nodes[0].bounds;
+        const auto &meshes = acceleration_structure->get_meshes();
+        int pixel_count = static_cast<int>(width * height);
+        std::vector<float3> colors;
+        std::vector<hit> hits;
+        std::vector<bounce> bounces;
+        std::vector<sampler> bounce_samplers;
+        std::vector<uint32_t> hit_meshes;
+        std::vector<unsigned int> shading_order;
+        uint32_t mesh_bits = 1;
+        while ((size_t{1} << mesh_bits) < meshes.size()) {
+            mesh_bits++;
+        }
+        ray_queue queue;
+        ray_queue next_queue;
+        auto miss = [&](unsigned int i) {
+            colors[queue.pixel[i]] += queue.get_weight(i) *
+                                          call_shader<payload>(this->miss_shader, queue.get_ray(i)).color.to_float3();
+        };
+        for (int first_pixel = 0; first_pixel < pixel_count; first_pixel += wavefront_batch_size) {
+            double batch_start = omp_get_wtime();
+            if (batch_start + wavefront_batch_time >= stop_time) {
+                return false;
+            }
+            int batch_size = std::min(wavefront_batch_size, pixel_count - first_pixel);
+            colors.assign(batch_size, float3{0.0f});
+            queue.clear();
+            for (int i = 0; i < batch_size; ++i) {
+                int x = (first_pixel + i) % static_cast<int>(width);
+                int y = (first_pixel + i) / static_cast<int>(width);
+                if (converged_tiles[get_tile_index(x, y)]) {
+                    continue;
+                }
+                sampler ray_sampler;
+                ray_sampler.start(static_cast<uint32_t>(y * width + x), sample_index, pixel_sampler_type);
+                float2 jitter = get_jitter(ray_sampler);
+                queue.push(ray(position, get_ray_direction(x, y, jitter, direction, right, up)), i, float3{1.0f},
+                           0.0f, ray_sampler);
+            }
+            for (size_t remaining_depth = depth; queue.size() > 0; --remaining_depth) {
+                int queue_size = static_cast<int>(queue.size());
+                // Paths out of bounces get what trace_ray returns at depth 0
+                if (remaining_depth == 0) {
+                    for (int i = 0; i < queue_size; ++i) {
+                        miss(i);
+                    }
+                    break;
+                }
+                // Camera rays are coherent already
+                if (remaining_depth < depth) {
+                    queue.sort(scene_bounds.get_min(), scene_bounds.get_max());
+                }
+                hits.resize(queue_size);
+#pragma omp parallel for
+                for (int i = 0; i < queue_size; ++i) {
+                    find_closest_hit(queue.get_ray(i), 1000.f, 0.001f, hits[i]);
+                }
+                // Hits are grouped by mesh, which is one material of the model, in the order of the sorted rays
+                hit_meshes.resize(queue_size);
+                for (int i = 0; i < queue_size; ++i) {
+                    if (hits[i].instance) {
+                        hit_meshes[i] = hits[i].instance->mesh_id;
+                    }
+                    else {
+                        hit_meshes[i] = 0;
+                        miss(i);
+                    }
+                }
+                shading_order = sort_by_key(hit_meshes, mesh_bits);
+                shading_order.erase(std::remove_if(shading_order.begin(), shading_order.end(), [&](unsigned int i) {
+                    return !hits[i].instance;
+                }), shading_order.end());
+                int hit_count = static_cast<int>(shading_order.size());
+                bounces.resize(queue_size);
+                bounce_samplers.resize(queue_size);
+#pragma omp parallel for
+                for (int j = 0; j < hit_count; ++j) {
+                    unsigned int i = shading_order[j];
+                    const hit &closest = hits[i];
+                    payload closest_hit_payload{};
+                    closest_hit_payload.t = closest.t;
+                    closest_hit_payload.bary = closest.bary;
+                    closest_hit_payload.ray_pdf = queue.pdf[i];
+                    triangle<VB> world_triangle = get_world_triangle(closest);
+                    get_sampler() = queue.samplers[i];
+                    bounces[i] = call_shader<bounce>(this->bounce_shader, queue.get_ray(i), closest_hit_payload,
+                                                     world_triangle, remaining_depth - 1);
+                    bounce_samplers[i] = get_sampler();
+                }
+                next_queue.clear();
+                for (int j = 0; j < hit_count; ++j) {
+                    unsigned int i = shading_order[j];
+                    float3 weight = queue.get_weight(i);
+                    colors[queue.pixel[i]] += weight * bounces[i].color;
+                    float3 next_weight = weight * bounces[i].next_weight;
+                    if (maxelem(next_weight) > 0.0f &&
+                        survives_russian_roulette(depth - remaining_depth, next_weight, bounce_samplers[i])) {
+                        next_queue.push(bounces[i].next_ray, queue.pixel[i], next_weight, bounces[i].next_pdf,
+                                        bounce_samplers[i]);
                     }
                 }
+                std::swap(queue, next_queue);
+            }
+#pragma omp parallel for
+            for (int i = 0; i < batch_size; ++i) {
+                int x = (first_pixel + i) % static_cast<int>(width);
+                int y = (first_pixel + i) / static_cast<int>(width);
+                if (!converged_tiles[get_tile_index(x, y)]) {
+                    accumulate(x, y, colors[i]);
+                }
             }
+            wavefront_batch_time = omp_get_wtime() - batch_start;
         }
+        return true;
     }
 
-    template<typename VB, typename RT>
-    inline payload raytracer<VB, RT>::trace_ray(
+    template<typename VB, typename RT, typename SHADERS>
+    inline payload raytracer<VB, RT, SHADERS>::trace_ray(
             const ray &ray, size_t depth, float max_t, float min_t) const {
         if (depth == 0) {
-            return miss_shader(ray);
+            return call_shader<payload>(this->miss_shader, ray);
+        }
+        depth--;
+        hit closest;
+        bool terminated = find_closest_hit(ray, max_t, min_t, closest);
+        return shade(ray, depth, closest, terminated);
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline bool raytracer<VB, RT, SHADERS>::find_closest_hit(const ray &ray, float max_t, float min_t, hit &closest) const {
+        closest = hit{};
+        closest.t = max_t;
+        unsigned int visited_nodes = 0;
+        const auto &instances = acceleration_structure->get_instances();
+        const auto &instance_indices = acceleration_structure->get_bvh().get_primitive_indices();
+        float3 inv_ray_direction = float3(1.0f) / ray.direction;
+        bool terminated = traverse(acceleration_structure->get_bvh(), ray, inv_ray_direction, closest.t, visited_nodes, [&](unsigned int first_instance, unsigned int instance_count) {
+            for (unsigned int i = first_instance; i < first_instance + instance_count; ++i) {
+                if (intersect_instance(instances[instance_indices[i]], ray, min_t, closest, visited_nodes)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+        auto &thread_statistics = statistics[omp_get_thread_num() % statistics.size()];
+        thread_statistics.rays++;
+        thread_statistics.visited_nodes += visited_nodes;
+        return terminated;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline bool raytracer<VB, RT, SHADERS>::intersect_instance(
+            const instance<VB> &instance, const ray &ray, float min_t, hit &closest,
+            unsigned int &visited_nodes) const {
+        const auto &mesh = acceleration_structure->get_meshes()[instance.mesh_id];
+        // Object space ray is normalized again, so distances are rescaled between the two spaces
+        float4 object_direction = mul(instance.inverse_world_matrix, float4{ray.direction, 0.0f});
+        float4 object_position = mul(instance.inverse_world_matrix, float4{ray.position, 1.0f});
+        float t_scale = length(object_direction.xyz());
+        cg::renderer::ray object_ray(object_position.xyz(), object_direction.xyz());
+        float3 inv_object_direction = float3(1.0f) / object_ray.direction;
+        float object_max_t = closest.t * t_scale;
+        float object_min_t = min_t * t_scale;
+        const auto &packets = mesh.get_packets();
+        return traverse(mesh.get_bvh(), object_ray, inv_object_direction, object_max_t, visited_nodes, [&](unsigned int first_triangle, unsigned int triangle_count) {
+            // Leaves start at a packet boundary, lanes past the last triangle are degenerate padding
+            float3 bary;
+            int slot = intersect_packets(&packets[first_triangle / triangle_packet::width], triangle_count,
+                                         object_ray, object_min_t, object_max_t, bary);
+            if (slot >= 0) {
+                closest.t = object_max_t / t_scale;
+                closest.bary = bary;
+                closest.triangle = first_triangle + slot;
+                closest.instance = &instance;
+                mesh.prefetch_shading(closest.triangle);
+                if (has_shader(this->any_hit_shader)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline payload raytracer<VB, RT, SHADERS>::shade(
+            const ray &ray, size_t depth, const hit &closest, bool terminated) const {
+        if (closest.instance) {
+            payload closest_hit_payload{};
+            closest_hit_payload.t = closest.t;
+            closest_hit_payload.bary = closest.bary;
+            if (!terminated && has_shader(this->bounce_shader) && !has_shader(this->any_hit_shader)) {
+                return trace_path(ray, depth, closest);
+            }
+            triangle<VB> world_triangle = get_world_triangle(closest);
+            if (terminated) {
+                return call_shader<payload>(this->any_hit_shader, ray, closest_hit_payload, world_triangle);
+            }
+            if (has_shader(this->closest_hit_shader)) {
+                return call_shader<payload>(this->closest_hit_shader, ray, closest_hit_payload, world_triangle, depth);
+            }
+        }
+        return call_shader<payload>(this->miss_shader, ray);
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline payload raytracer<VB, RT, SHADERS>::trace_path(const ray &first_ray, size_t depth, const hit &first_hit) const {
+        float3 color{0.0f};
+        float3 weight{1.0f};
+        ray path_ray = first_ray;
+        float ray_pdf = 0.0f;
+        hit closest = first_hit;
+        for (size_t bounce_id = 0;; ++bounce_id) {
+            if (!closest.instance) {
+                color += weight * call_shader<payload>(this->miss_shader, path_ray).color.to_float3();
+                break;
+            }
+            payload closest_hit_payload{};
+            closest_hit_payload.t = closest.t;
+            closest_hit_payload.bary = closest.bary;
+            closest_hit_payload.ray_pdf = ray_pdf;
+            bounce result = call_shader<bounce>(this->bounce_shader, path_ray, closest_hit_payload,
+                                                get_world_triangle(closest), depth);
+            color += weight * result.color;
+            weight *= result.next_weight;
+            if (maxelem(weight) <= 0.0f || !survives_russian_roulette(bounce_id, weight, get_sampler())) {
+                break;
+            }
+            // Paths out of bounces get what trace_ray returns at depth 0
+            if (depth == 0) {
+                color += weight * call_shader<payload>(this->miss_shader, result.next_ray).color.to_float3();
+                break;
+            }
+            depth--;
+            path_ray = result.next_ray;
+            ray_pdf = result.next_pdf;
+            find_closest_hit(path_ray, 1000.f, 0.001f, closest);
+        }
+        payload result{};
+        result.t = first_hit.t;
+        result.bary = first_hit.bary;
+        result.color = cg::color::from_float3(color);
+        return result;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline bool raytracer<VB, RT, SHADERS>::survives_russian_roulette(
+            size_t bounce_id, float3 &weight, sampler &path_sampler) const {
+        if (bounce_id < russian_roulette_depth) {
+            return true;
+        }
+        float survival = std::min(maxelem(weight), 0.95f);
+        if (path_sampler.get_1d() >= survival) {
+            return false;
+        }
+        weight /= survival;
+        return true;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline triangle<VB> raytracer<VB, RT, SHADERS>::get_world_triangle(const hit &closest) const {
+        const auto &mesh = acceleration_structure->get_meshes()[closest.instance->mesh_id];
+        return closest.instance->to_world(mesh.get_triangle(closest.triangle));
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::trace_packet(
+            const ray *rays, unsigned int count, size_t depth, payload *payloads, float max_t, float min_t,
+            const sampler *ray_samplers) const {
+        bool shared_origin = true;
+        for (unsigned int i = 1; i < count; ++i) {
+            shared_origin = shared_origin && rays[i].position == rays[0].position;
+        }
+        ray_packet packet;
+        if (count <= ray_packet::max_size && shared_origin) {
+            packet.origin = rays[0].position;
+            for (unsigned int i = 0; i < count; ++i) {
+                packet.set_ray(i, rays[i].direction, min_t, max_t);
+            }
+            packet.set_count(count);
+        }
+        ray_frustum frustum;
+        if (depth == 0 || count < 2 || has_shader(this->any_hit_shader) || packet.count == 0 || !frustum.init(packet)) {
+            for (unsigned int i = 0; i < count; ++i) {
+                if (ray_samplers) {
+                    get_sampler() = ray_samplers[i];
+                }
+                payloads[i] = trace_ray(rays[i], depth, max_t, min_t);
+            }
+            return;
         }
         depth--;
-        payload closest_hit_payload{};
-        closest_hit_payload.t = max_t;
-        const triangle<VB> *closest_triangle = nullptr;
-        for (const auto &aabb: acceleration_structures) {
-            if (!aabb.aabb_test(ray)) {
+        hit closest[ray_packet::max_size];
+        for (unsigned int i = 0; i < count; ++i) {
+            closest[i].t = max_t;
+        }
+        unsigned int visited_nodes = 0;
+        const auto &instances = acceleration_structure->get_instances();
+        const auto &instance_indices = acceleration_structure->get_bvh().get_primitive_indices();
+        traverse_packet(acceleration_structure->get_bvh(), packet, frustum, visited_nodes, [&](unsigned int first_instance, unsigned int instance_count, unsigned int, const aabb<VB> &) {
+            for (unsigned int i = first_instance; i < first_instance + instance_count; ++i) {
+                intersect_instance_packet(instances[instance_indices[i]], rays, packet, closest, visited_nodes);
+            }
+        });
+        auto &thread_statistics = statistics[omp_get_thread_num() % statistics.size()];
+        thread_statistics.rays += count;
+        thread_statistics.visited_nodes += visited_nodes;
+        for (unsigned int i = 0; i < count; ++i) {
+            if (ray_samplers) {
+                get_sampler() = ray_samplers[i];
+            }
+            payloads[i] = shade(rays[i], depth, closest[i], false);
+        }
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline bool raytracer<VB, RT, SHADERS>::occluded(const ray &ray, float max_t, float min_t) const {
+        unsigned int visited_nodes = 0;
+        const auto &meshes = acceleration_structure->get_meshes();
+        const auto &instances = acceleration_structure->get_instances();
+        const auto &instance_indices = acceleration_structure->get_bvh().get_primitive_indices();
+        float3 inv_ray_direction = float3(1.0f) / ray.direction;
+        bool hit = traverse(acceleration_structure->get_bvh(), ray, inv_ray_direction, max_t, visited_nodes, [&](unsigned int first_instance, unsigned int instance_count) {
+            for (unsigned int i = first_instance; i < first_instance + instance_count; ++i) {
+                const auto &instance = instances[instance_indices[i]];
+                const auto &mesh = meshes[instance.mesh_id];
+                float4 object_direction = mul(instance.inverse_world_matrix, float4{ray.direction, 0.0f});
+                float4 object_position = mul(instance.inverse_world_matrix, float4{ray.position, 1.0f});
+                float t_scale = length(object_direction.xyz());
+                cg::renderer::ray object_ray(object_position.xyz(), object_direction.xyz());
+                float3 inv_object_direction = float3(1.0f) / object_ray.direction;
+                float object_max_t = max_t * t_scale;
+                float object_min_t = min_t * t_scale;
+                const auto &packets = mesh.get_packets();
+                bool mesh_hit = traverse(mesh.get_bvh(), object_ray, inv_object_direction, object_max_t, visited_nodes, [&](unsigned int first_triangle, unsigned int triangle_count) {
+                    return intersect_packets_any(&packets[first_triangle / triangle_packet::width], triangle_count,
+                                                 object_ray, object_min_t, object_max_t);
+                });
+                if (mesh_hit) {
+                    return true;
+                }
+            }
+            return false;
+        });
+        auto &thread_statistics = statistics[omp_get_thread_num() % statistics.size()];
+        thread_statistics.rays++;
+        thread_statistics.visited_nodes += visited_nodes;
+        return hit;
+    }
+
+    // Walks a BVH front to back with a fixed-size stack and hands every reached leaf range to the callback.
+    // max_t is re-read after each leaf, so the callback shrinks it as closer hits are found.
+    // Returns true when the callback terminates the traversal.
+    template<typename VB, typename RT, typename SHADERS>
+    template<typename LEAF>
+    inline bool raytracer<VB, RT, SHADERS>::traverse(
+            const bvh<VB> &tree, const ray &ray, const float3 &inv_ray_direction,
+            const float &max_t, unsigned int &visited_nodes, LEAF &&leaf) const {
+        switch (tree.get_width()) {
+            case 4:
+                return traverse_wide(tree.get_bvh4(), ray, inv_ray_direction, max_t, visited_nodes, leaf);
+            case 8:
+                return traverse_wide(tree.get_bvh8(), ray, inv_ray_direction, max_t, visited_nodes, leaf);
+            default:
+                return traverse_binary(tree, ray, inv_ray_direction, max_t, visited_nodes, leaf);
+        }
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    template<typename LEAF>
+    inline bool raytracer<VB, RT, SHADERS>::traverse_binary(
+            const bvh<VB> &tree, const ray &ray, const float3 &inv_ray_direction,
+            const float &max_t, unsigned int &visited_nodes, LEAF &&leaf) const {
+        const auto &nodes = tree.get_nodes();
+        float t_node;
+        if (nodes.empty() || !nodes[0].bounds.aabb_test(ray, inv_ray_direction, max_t, t_node)) {
+            return false;
+        }
+        struct stack_entry {
+            unsigned int node_id;
+            float t_near;
+        };
+        stack_entry stack[bvh<VB>::max_depth];
+        unsigned int stack_size = 0;
+        unsigned int node_id = 0;
+        while (true) {
+            if (t_node < max_t) {
+                visited_nodes++;
+                const auto &node = nodes[node_id];
+                if (node.primitive_count > 0) {
+                    if (leaf(node.offset, node.primitive_count)) {
+                        return true;
+                    }
+                }
+                else {
+                    unsigned int near_child = node_id + 1;
+                    unsigned int far_child = node.offset;
+                    float t_near, t_far;
+                    bool hit_near = nodes[near_child].bounds.aabb_test(ray, inv_ray_direction, max_t, t_near);
+                    bool hit_far = nodes[far_child].bounds.aabb_test(ray, inv_ray_direction, max_t, t_far);
+                    if (hit_near && hit_far) {
+                        if (t_far < t_near) {
+                            std::swap(near_child, far_child);
+                            std::swap(t_near, t_far);
+                        }
+                        stack[stack_size++] = {far_child, t_far};
+                    }
+                    if (hit_near || hit_far) {
+                        node_id = hit_near ? near_child : far_child;
+                        t_node = hit_near ? t_near : t_far;
+                        continue;
+                    }
+                }
+            }
+            if (stack_size == 0) {
+                return false;
+            }
+            stack_size--;
+            node_id = stack[stack_size].node_id;
+            t_node = stack[stack_size].t_near;
+        }
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    template<unsigned int N, typename LEAF>
+    inline bool raytracer<VB, RT, SHADERS>::traverse_wide(
+            const wide_bvh<VB, N> &tree, const ray &ray, const float3 &inv_ray_direction,
+            const float &max_t, unsigned int &visited_nodes, LEAF &&leaf) const {
+        const auto &nodes = tree.get_nodes();
+        if (nodes.empty()) {
+            return false;
+        }
+        // Leaf ranges go through the stack as well, so children are processed strictly by distance
+        struct stack_entry {
+            unsigned int child;
+            unsigned int primitive_count;
+            float t_near;
+        };
+        stack_entry stack[bvh<VB>::max_depth * N];
+        unsigned int stack_size = 1;
+        stack[0] = {0, 0, 0.0f};
+        while (stack_size > 0) {
+            stack_entry entry = stack[--stack_size];
+            if (entry.t_near >= max_t) {
                 continue;
             }
-            for (const auto &triangle: aabb.get_triangles()) {
-                payload p = intersection_shader(triangle, ray);
-                if (p.t > min_t && p.t < closest_hit_payload.t) {
-                    closest_hit_payload = p;
-                    closest_triangle = &triangle;
-                    if (any_hit_shader) {
-                        return any_hit_shader(ray, p, triangle);
+            if (entry.primitive_count > 0) {
+                if (leaf(entry.child, entry.primitive_count)) {
+                    return true;
+                }
+                continue;
+            }
+            visited_nodes++;
+            const auto &node = nodes[entry.child];
+            float t_near[N];
+            unsigned int hit_mask = node.intersect(ray, inv_ray_direction, max_t, t_near);
+            unsigned int first_hit = stack_size;
+            for (unsigned int i = 0; i < N; ++i) {
+                if (!(hit_mask & (1u << i))) {
+                    continue;
+                }
+                // Keep the pushed children sorted so the nearest one is on top of the stack
+                unsigned int j = stack_size++;
+                stack[j] = {node.child[i], node.primitive_count[i], t_near[i]};
+                while (j > first_hit && stack[j - 1].t_near < stack[j].t_near) {
+                    std::swap(stack[j - 1], stack[j]);
+                    j--;
+                }
+            }
+        }
+        return false;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    template<typename LEAF>
+    inline void raytracer<VB, RT, SHADERS>::traverse_packet(
+            const bvh<VB> &tree, const ray_packet &packet, const ray_frustum &frustum, unsigned int &visited_nodes,
+            LEAF &&leaf) const {
+        const auto &nodes = tree.get_nodes();
+        float max_t = packet.get_max_t();
+        // Finds the first group of rays entering the box, groups before first_group already missed its parent
+        auto enters = [&](const aabb<VB> &bounds, unsigned int &first_group, float &t_near) {
+            if (!frustum.intersect(bounds, max_t, t_near)) {
+                return false;
+            }
+            for (; first_group < packet.count; first_group += ray_packet::group_size) {
+                if (packet.intersect_box(first_group, bounds.get_min(), bounds.get_max())) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        struct stack_entry {
+            unsigned int node_id;
+            unsigned int first_group;
+            float t_near;
+        };
+        stack_entry stack[bvh<VB>::max_depth];
+        unsigned int stack_size = 0;
+        stack_entry current{0, 0, 0.0f};
+        if (nodes.empty() || !enters(nodes[0].bounds, current.first_group, current.t_near)) {
+            return;
+        }
+        while (true) {
+            if (current.t_near < max_t) {
+                visited_nodes++;
+                const auto &node = nodes[current.node_id];
+                if (node.primitive_count > 0) {
+                    leaf(node.offset, node.primitive_count, current.first_group, node.bounds);
+                    max_t = packet.get_max_t();
+                }
+                else {
+                    stack_entry near_child{current.node_id + 1, current.first_group, 0.0f};
+                    stack_entry far_child{node.offset, current.first_group, 0.0f};
+                    bool hit_near = enters(nodes[near_child.node_id].bounds, near_child.first_group, near_child.t_near);
+                    bool hit_far = enters(nodes[far_child.node_id].bounds, far_child.first_group, far_child.t_near);
+                    if (hit_near && hit_far) {
+                        if (far_child.t_near < near_child.t_near) {
+                            std::swap(near_child, far_child);
+                        }
+                        stack[stack_size++] = far_child;
+                    }
+                    if (hit_near || hit_far) {
+                        current = hit_near ? near_child : far_child;
+                        continue;
                     }
                 }
             }
+            if (stack_size == 0) {
+                return;
+            }
+            current = stack[--stack_size];
+        }
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::intersect_instance_packet(
+            const instance<VB> &instance, const ray *rays, ray_packet &packet, hit *closest,
+            unsigned int &visited_nodes) const {
+        const auto &mesh = acceleration_structure->get_meshes()[instance.mesh_id];
+        ray_packet object_packet;
+        float t_scale[ray_packet::max_size];
+        float4 object_position = mul(instance.inverse_world_matrix, float4{packet.origin, 1.0f});
+        object_packet.origin = object_position.xyz();
+        for (unsigned int i = 0; i < packet.count; ++i) {
+            float4 object_direction = mul(instance.inverse_world_matrix, float4{rays[i].direction, 0.0f});
+            t_scale[i] = length(object_direction.xyz());
+            // Same normalization as the object space ray of a single ray
+            cg::renderer::ray object_ray(object_packet.origin, object_direction.xyz());
+            object_packet.set_ray(i, object_ray.direction, packet.min_t[i] * t_scale[i], closest[i].t * t_scale[i]);
+        }
+        object_packet.set_count(packet.count);
+        // Transforms can flip direction signs inside the packet, then its rays go through the mesh one by one
+        ray_frustum frustum;
+        if (!frustum.init(object_packet)) {
+            for (unsigned int i = 0; i < packet.count; ++i) {
+                intersect_instance(instance, rays[i], packet.min_t[i], closest[i], visited_nodes);
+                packet.max_t[i] = closest[i].t;
+            }
+            return;
         }
-        if (closest_hit_payload.t < max_t) {
-            if (closest_hit_shader) {
-                return closest_hit_shader(ray, closest_hit_payload, *closest_triangle, depth);
+        const auto &packets = mesh.get_packets();
+        traverse_packet(mesh.get_bvh(), object_packet, frustum, visited_nodes, [&](unsigned int first_triangle, unsigned int triangle_count, unsigned int first_group, const aabb<VB> &bounds) {
+            // The frustum only bounds the packet, groups missing the leaf skip its triangles
+            unsigned int group_mask = 0;
+            for (unsigned int first = first_group; first < object_packet.count; first += ray_packet::group_size) {
+                if (object_packet.intersect_box(first, bounds.get_min(), bounds.get_max())) {
+                    group_mask |= 1u << (first / ray_packet::group_size);
+                }
+            }
+            for (unsigned int slot = first_triangle; group_mask && slot < first_triangle + triangle_count; ++slot) {
+                const auto &triangles = packets[slot / triangle_packet::width];
+                unsigned int lane = slot % triangle_packet::width;
+                object_packet.intersect_triangle(
+                        group_mask, float3{triangles.a[0][lane], triangles.a[1][lane], triangles.a[2][lane]},
+                        float3{triangles.ba[0][lane], triangles.ba[1][lane], triangles.ba[2][lane]},
+                        float3{triangles.ca[0][lane], triangles.ca[1][lane], triangles.ca[2][lane]},
+                        static_cast<int>(slot));
+            }
+        });
+        for (unsigned int i = 0; i < packet.count; ++i) {
+            if (object_packet.triangle[i] < 0) {
+                continue;
             }
+            closest[i].t = object_packet.max_t[i] / t_scale[i];
+            closest[i].bary = float3{1.0f - object_packet.u[i] - object_packet.v[i], object_packet.u[i], object_packet.v[i]};
+            closest[i].triangle = static_cast<unsigned int>(object_packet.triangle[i]);
+            closest[i].instance = &instance;
+            packet.max_t[i] = closest[i].t;
         }
-        return miss_shader(ray);
     }
 
-    template<typename VB, typename RT>
-    inline payload raytracer<VB, RT>::intersection_shader(
+    template<typename VB, typename RT, typename SHADERS>
+    inline payload raytracer<VB, RT, SHADERS>::intersection_shader(
             const triangle <VB> &triangle, const ray &ray) const {
         payload p{};
         p.t = -1.0f;
@@ -280,60 +2092,1547 @@ namespace cg::renderer {
         return p;
     }
 
-    template<typename VB, typename RT>
-    float2 raytracer<VB, RT>::get_jitter(int frame_id) {
-        float2 result{0.0f, 0.0f};
-        constexpr int base_x = 2;
-        int index = frame_id + 1;
-        float inv_base = 1.0f / base_x;
-        float fraction = inv_base;
-        while (index > 0) {
+    // Möller-Trumbore tests of one ray against packed triangles. Every kernel runs the same float operations
+    // in the same order and writes t and the barycentrics of each lane, the mask marks hits in (min_t, max_t).
+    constexpr float triangle_epsilon = 1e-8f;
 
-            result.x += static_cast<float>(index % base_x) * fraction;
-            index /= base_x;
-            fraction *= inv_base;
-        }
-        constexpr int base_y = 3;
-        index = frame_id + 1;
-        inv_base = 1.0f / base_y;
-        fraction = inv_base;
-        while (index > 0) {
-            result.y += static_cast<float>(index % base_y) * fraction;
-            index /= base_y;
-            fraction *= inv_base;
+    inline unsigned int intersect_triangles_4(
+            const triangle_packet &packet, const ray &ray, float min_t, float max_t, float *t, float *u, float *v) {
+        const float3 &d = ray.direction;
+        const float3 &o = ray.position;
+        unsigned int hit_mask = 0;
+        for (unsigned int i = 0; i < 4; ++i) {
+            float px = d.y * packet.ca[2][i] - d.z * packet.ca[1][i];
+            float py = d.z * packet.ca[0][i] - d.x * packet.ca[2][i];
+            float pz = d.x * packet.ca[1][i] - d.y * packet.ca[0][i];
+            float det = packet.ba[0][i] * px + packet.ba[1][i] * py + packet.ba[2][i] * pz;
+            float inv_det = 1.0f / det;
+            float tx = o.x - packet.a[0][i];
+            float ty = o.y - packet.a[1][i];
+            float tz = o.z - packet.a[2][i];
+            u[i] = (tx * px + ty * py + tz * pz) * inv_det;
+            float qx = ty * packet.ba[2][i] - tz * packet.ba[1][i];
+            float qy = tz * packet.ba[0][i] - tx * packet.ba[2][i];
+            float qz = tx * packet.ba[1][i] - ty * packet.ba[0][i];
+            v[i] = (d.x * qx + d.y * qy + d.z * qz) * inv_det;
+            t[i] = (packet.ca[0][i] * qx + packet.ca[1][i] * qy + packet.ca[2][i] * qz) * inv_det;
+            bool degenerate = det > -triangle_epsilon && det < triangle_epsilon;
+            if (!degenerate && u[i] >= 0.0f && u[i] <= 1.0f && v[i] >= 0.0f && u[i] + v[i] <= 1.0f &&
+                t[i] > min_t && t[i] < max_t) {
+                hit_mask |= 1u << i;
+            }
         }
-        return result - 0.5f;
+        return hit_mask;
     }
 
+#ifdef CG_SIMD_X86
+    inline unsigned int intersect_triangles_4_sse(
+            const triangle_packet &packet, const ray &ray, float min_t, float max_t, float *t, float *u, float *v) {
+        __m128 dx = _mm_set1_ps(ray.direction.x);
+        __m128 dy = _mm_set1_ps(ray.direction.y);
+        __m128 dz = _mm_set1_ps(ray.direction.z);
+        __m128 bax = _mm_load_ps(packet.ba[0]);
+        __m128 bay = _mm_load_ps(packet.ba[1]);
+        __m128 baz = _mm_load_ps(packet.ba[2]);
+        __m128 cax = _mm_load_ps(packet.ca[0]);
+        __m128 cay = _mm_load_ps(packet.ca[1]);
+        __m128 caz = _mm_load_ps(packet.ca[2]);
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, caz), _mm_mul_ps(dz, cay));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, cax), _mm_mul_ps(dx, caz));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, cay), _mm_mul_ps(dy, cax));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(bax, px), _mm_mul_ps(bay, py)), _mm_mul_ps(baz, pz));
+        __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.position.x), _mm_load_ps(packet.a[0]));
+        __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.position.y), _mm_load_ps(packet.a[1]));
+        __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.position.z), _mm_load_ps(packet.a[2]));
+        __m128 u4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, baz), _mm_mul_ps(tz, bay));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, bax), _mm_mul_ps(tx, baz));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, bay), _mm_mul_ps(ty, bax));
+        __m128 v4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+        __m128 t4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cax, qx), _mm_mul_ps(cay, qy)), _mm_mul_ps(caz, qz)), inv_det);
+        __m128 degenerate = _mm_and_ps(_mm_cmpgt_ps(det, _mm_set1_ps(-triangle_epsilon)),
+                                       _mm_cmplt_ps(det, _mm_set1_ps(triangle_epsilon)));
+        __m128 zero = _mm_setzero_ps();
+        __m128 one = _mm_set1_ps(1.0f);
+        __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u4, zero), _mm_cmple_ps(u4, one)),
+                                   _mm_and_ps(_mm_cmpge_ps(v4, zero), _mm_cmple_ps(_mm_add_ps(u4, v4), one)));
+        __m128 in_range = _mm_and_ps(_mm_cmpgt_ps(t4, _mm_set1_ps(min_t)), _mm_cmplt_ps(t4, _mm_set1_ps(max_t)));
+        _mm_storeu_ps(t, t4);
+        _mm_storeu_ps(u, u4);
+        _mm_storeu_ps(v, v4);
+        return static_cast<unsigned int>(_mm_movemask_ps(_mm_andnot_ps(degenerate, _mm_and_ps(inside, in_range))));
+    }
 
-    template<typename VB>
-    inline void aabb<VB>::add_triangle(const triangle <VB> triangle) {
-        if (triangles.empty()) {
-            aabb_min = aabb_max = triangle.a;
-        }
-        triangles.push_back(triangle);
-        aabb_max = max(aabb_max, triangle.a);
-        aabb_max = max(aabb_max, triangle.b);
-        aabb_max = max(aabb_max, triangle.c);
+    CG_TARGET_AVX inline __m256 load_triangle_rows(const float *low, const float *high) {
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(low)), _mm_load_ps(high), 1);
+    }
 
-        aabb_min = min(aabb_min, triangle.a);
-        aabb_min = min(aabb_min, triangle.b);
-        aabb_min = min(aabb_min, triangle.c);
+    // Tests two consecutive packets at once
+    CG_TARGET_AVX inline unsigned int intersect_triangles_8_avx(
+            const triangle_packet *packets, const ray &ray, float min_t, float max_t, float *t, float *u, float *v) {
+        const triangle_packet &low = packets[0];
+        const triangle_packet &high = packets[1];
+        __m256 dx = _mm256_set1_ps(ray.direction.x);
+        __m256 dy = _mm256_set1_ps(ray.direction.y);
+        __m256 dz = _mm256_set1_ps(ray.direction.z);
+        __m256 bax = load_triangle_rows(low.ba[0], high.ba[0]);
+        __m256 bay = load_triangle_rows(low.ba[1], high.ba[1]);
+        __m256 baz = load_triangle_rows(low.ba[2], high.ba[2]);
+        __m256 cax = load_triangle_rows(low.ca[0], high.ca[0]);
+        __m256 cay = load_triangle_rows(low.ca[1], high.ca[1]);
+        __m256 caz = load_triangle_rows(low.ca[2], high.ca[2]);
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, caz), _mm256_mul_ps(dz, cay));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, cax), _mm256_mul_ps(dx, caz));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, cay), _mm256_mul_ps(dy, cax));
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(bax, px), _mm256_mul_ps(bay, py)), _mm256_mul_ps(baz, pz));
+        __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+        __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.position.x), load_triangle_rows(low.a[0], high.a[0]));
+        __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.position.y), load_triangle_rows(low.a[1], high.a[1]));
+        __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.position.z), load_triangle_rows(low.a[2], high.a[2]));
+        __m256 u8 = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, baz), _mm256_mul_ps(tz, bay));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, bax), _mm256_mul_ps(tx, baz));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, bay), _mm256_mul_ps(ty, bax));
+        __m256 v8 = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+        __m256 t8 = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cax, qx), _mm256_mul_ps(cay, qy)), _mm256_mul_ps(caz, qz)), inv_det);
+        __m256 degenerate = _mm256_and_ps(_mm256_cmp_ps(det, _mm256_set1_ps(-triangle_epsilon), _CMP_GT_OQ),
+                                          _mm256_cmp_ps(det, _mm256_set1_ps(triangle_epsilon), _CMP_LT_OQ));
+        __m256 zero = _mm256_setzero_ps();
+        __m256 one = _mm256_set1_ps(1.0f);
+        __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(u8, zero, _CMP_GE_OQ), _mm256_cmp_ps(u8, one, _CMP_LE_OQ)),
+                                      _mm256_and_ps(_mm256_cmp_ps(v8, zero, _CMP_GE_OQ),
+                                                    _mm256_cmp_ps(_mm256_add_ps(u8, v8), one, _CMP_LE_OQ)));
+        __m256 in_range = _mm256_and_ps(_mm256_cmp_ps(t8, _mm256_set1_ps(min_t), _CMP_GT_OQ),
+                                        _mm256_cmp_ps(t8, _mm256_set1_ps(max_t), _CMP_LT_OQ));
+        _mm256_storeu_ps(t, t8);
+        _mm256_storeu_ps(u, u8);
+        _mm256_storeu_ps(v, v8);
+        return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_andnot_ps(degenerate, _mm256_and_ps(inside, in_range))));
     }
+#endif
 
-    template<typename VB>
-    inline const std::vector<triangle<VB>> &aabb<VB>::get_triangles() const {
-        return triangles;
+    // Tests the next 8 or 4 triangles with the best kernel available
+    template<typename VB, typename RT, typename SHADERS>
+    inline unsigned int raytracer<VB, RT, SHADERS>::intersect_triangle_batch(
+            const triangle_packet *packets, unsigned int count, const ray &ray, float min_t, float max_t,
+            float *t, float *u, float *v, unsigned int &lane_count) {
+        static_assert(triangle_packet::width == 4, "Triangle kernels test packets of 4 triangles");
+        lane_count = triangle_packet::width;
+#ifdef CG_SIMD_X86
+        simd::isa isa = simd::get_isa();
+        if (isa == simd::isa::avx2 && count > triangle_packet::width) {
+            lane_count = 2 * triangle_packet::width;
+            return intersect_triangles_8_avx(packets, ray, min_t, max_t, t, u, v);
+        }
+        if (isa != simd::isa::scalar) {
+            return intersect_triangles_4_sse(*packets, ray, min_t, max_t, t, u, v);
+        }
+#endif
+        return intersect_triangles_4(*packets, ray, min_t, max_t, t, u, v);
     }
 
-    template<typename VB>
-    inline bool aabb<VB>::aabb_test(const ray &ray) const {
-        float3 inv_ray_direction = float3(1.0f) / ray.direction;
+    template<typename VB, typename RT, typename SHADERS>
+    inline int raytracer<VB, RT, SHADERS>::intersect_packets(
+            const triangle_packet *packets, unsigned int count, const ray &ray,
+            float min_t, float &max_t, float3 &bary) {
+        float t[2 * triangle_packet::width];
+        float u[2 * triangle_packet::width];
+        float v[2 * triangle_packet::width];
+        int closest = -1;
+        unsigned int lane_count;
+        for (unsigned int first = 0; first < count; first += lane_count) {
+            unsigned int hit_mask = intersect_triangle_batch(packets + first / triangle_packet::width, count - first,
+                                                             ray, min_t, max_t, t, u, v, lane_count);
+            // The first of equally close lanes wins, as with one triangle at a time
+            for (unsigned int lane = 0; lane < lane_count; ++lane) {
+                if ((hit_mask >> lane & 1u) && t[lane] < max_t) {
+                    max_t = t[lane];
+                    bary = float3{1.0f - u[lane] - v[lane], u[lane], v[lane]};
+                    closest = static_cast<int>(first + lane);
+                }
+            }
+        }
+        return closest;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline bool raytracer<VB, RT, SHADERS>::intersect_packets_any(
+            const triangle_packet *packets, unsigned int count, const ray &ray, float min_t, float max_t) {
+        float t[2 * triangle_packet::width];
+        float u[2 * triangle_packet::width];
+        float v[2 * triangle_packet::width];
+        unsigned int lane_count;
+        for (unsigned int first = 0; first < count; first += lane_count) {
+            if (intersect_triangle_batch(packets + first / triangle_packet::width, count - first, ray, min_t, max_t,
+                                         t, u, v, lane_count)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    template<typename RESULT, typename SHADER, typename... ARGS>
+    inline RESULT raytracer<VB, RT, SHADERS>::call_shader(const SHADER &shader, ARGS &&...args) const {
+        if constexpr (std::is_same_v<SHADER, no_shader>) {
+            return RESULT{};
+        }
+        else if constexpr (std::is_invocable_v<const SHADER &, const raytracer &, ARGS...>) {
+            return shader(*this, std::forward<ARGS>(args)...);
+        }
+        else {
+            return shader(std::forward<ARGS>(args)...);
+        }
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline float2 raytracer<VB, RT, SHADERS>::get_jitter(sampler &pixel_sampler) const {
+        return pixel_sampler.get_2d() - 0.5f;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline ray_statistics raytracer<VB, RT, SHADERS>::get_ray_statistics() const {
+        ray_statistics result;
+        for (const auto &thread_statistics: statistics) {
+            result.rays += thread_statistics.rays;
+            result.visited_nodes += thread_statistics.visited_nodes;
+            result.busy_time += thread_statistics.busy_time;
+        }
+        return result;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline const std::vector<ray_statistics> &raytracer<VB, RT, SHADERS>::get_thread_statistics() const {
+        return statistics;
+    }
+
+    template<typename VB, typename RT, typename SHADERS>
+    inline void raytracer<VB, RT, SHADERS>::reset_ray_statistics() {
+        std::fill(statistics.begin(), statistics.end(), ray_statistics{});
+    }
+
+    template<typename VB>
+    inline void aabb<VB>::add_point(const float3 &point) {
+        aabb_max = max(aabb_max, point);
+        aabb_min = min(aabb_min, point);
+    }
+
+    template<typename VB>
+    inline void aabb<VB>::add_triangle(const triangle<VB> &triangle) {
+        add_point(triangle.a);
+        add_point(triangle.b);
+        add_point(triangle.c);
+    }
+
+    template<typename VB>
+    inline void aabb<VB>::add_aabb(const aabb<VB> &other) {
+        aabb_max = max(aabb_max, other.aabb_max);
+        aabb_min = min(aabb_min, other.aabb_min);
+    }
+
+    template<typename VB>
+    inline aabb<VB> aabb<VB>::transform(const float4x4 &matrix) const {
+        aabb<VB> result;
+        for (int corner = 0; corner < 8; ++corner) {
+            float4 point{
+                    corner & 1 ? aabb_max.x : aabb_min.x,
+                    corner & 2 ? aabb_max.y : aabb_min.y,
+                    corner & 4 ? aabb_max.z : aabb_min.z,
+                    1.0f};
+            result.add_point(mul(matrix, point).xyz());
+        }
+        return result;
+    }
+
+    template<typename VB>
+    inline float3 aabb<VB>::get_center() const {
+        return (aabb_min + aabb_max) * 0.5f;
+    }
+
+    template<typename VB>
+    inline float aabb<VB>::get_surface_area() const {
+        float3 extent = max(aabb_max - aabb_min, float3(0.0f));
+        return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+
+    template<typename VB>
+    inline int aabb<VB>::get_largest_axis() const {
+        float3 extent = aabb_max - aabb_min;
+        if (extent.x >= extent.y && extent.x >= extent.z) {
+            return 0;
+        }
+        return extent.y >= extent.z ? 1 : 2;
+    }
+
+    template<typename VB>
+    inline const float3 &aabb<VB>::get_min() const {
+        return aabb_min;
+    }
+
+    template<typename VB>
+    inline const float3 &aabb<VB>::get_max() const {
+        return aabb_max;
+    }
+
+    template<typename VB>
+    inline bool aabb<VB>::aabb_test(
+            const ray &ray, const float3 &inv_ray_direction, float max_t, float &t_near) const {
         float3 r0 = (aabb_max - ray.position) * inv_ray_direction;
         float3 r1 = (aabb_min - ray.position) * inv_ray_direction;
         float3 tmax = max(r0, r1);
         float3 tmin = min(r0, r1);
-        return maxelem(tmin) <= maxelem(tmax);
+        t_near = std::max(maxelem(tmin), 0.0f);
+        return t_near <= std::min(minelem(tmax), max_t);
+    }
+
+    template<typename T>
+    inline void write_cache_vector(std::ostream &stream, const std::vector<T> &values) {
+        uint64_t count = values.size();
+        stream.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        stream.write(reinterpret_cast<const char *>(values.data()), static_cast<std::streamsize>(count * sizeof(T)));
+    }
+
+    template<typename T>
+    inline bool read_cache_vector(const char *&data, const char *end, std::vector<T> &values) {
+        uint64_t count;
+        if (static_cast<size_t>(end - data) < sizeof(count)) {
+            return false;
+        }
+        std::memcpy(&count, data, sizeof(count));
+        data += sizeof(count);
+        if (count > static_cast<size_t>(end - data) / sizeof(T)) {
+            return false;
+        }
+        values.resize(count);
+        std::memcpy(values.data(), data, count * sizeof(T));
+        data += count * sizeof(T);
+        return true;
+    }
+
+    template<typename VB>
+    inline void bvh<VB>::build(const std::vector<aabb<VB>> &primitive_bounds) {
+        nodes.clear();
+        primitive_indices.resize(primitive_bounds.size());
+        std::iota(primitive_indices.begin(), primitive_indices.end(), 0);
+        build_sah_cost = 0.0f;
+        if (primitive_bounds.empty()) {
+            return;
+        }
+        build_input input{primitive_bounds, std::vector<float3>(primitive_bounds.size())};
+        int primitive_count = static_cast<int>(primitive_bounds.size());
+#pragma omp parallel for
+        for (int i = 0; i < primitive_count; ++i) {
+            input.centroids[i] = primitive_bounds[i].get_center();
+        }
+
+        std::vector<bvh_node<VB>> top_nodes;
+        std::vector<int> top_subtrees;
+        std::vector<subtree> subtrees;
+        unsigned int subtree_size = std::max(static_cast<unsigned int>(primitive_count) / (4 * omp_get_max_threads()),
+                                             min_subtree_size);
+        build_top_node(top_nodes, top_subtrees, subtrees, 0, static_cast<unsigned int>(primitive_count), 1,
+                       subtree_size, input);
+        int subtree_count = static_cast<int>(subtrees.size());
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int i = 0; i < subtree_count; ++i) {
+            auto &task = subtrees[i];
+            task.nodes.reserve(2 * task.count - 1);
+            build_node(task.nodes, task.first, task.count, task.depth, input);
+        }
+
+        // Splice the subtrees in place of their top-level placeholders, keeping the depth-first order
+        std::vector<unsigned int> final_ids(top_nodes.size());
+        nodes.reserve(2 * primitive_bounds.size() - 1);
+        for (size_t i = 0; i < top_nodes.size(); ++i) {
+            final_ids[i] = static_cast<unsigned int>(nodes.size());
+            if (top_subtrees[i] < 0) {
+                nodes.push_back(top_nodes[i]);
+                continue;
+            }
+            for (auto node: subtrees[top_subtrees[i]].nodes) {
+                if (node.primitive_count == 0) {
+                    node.offset += final_ids[i];
+                }
+                nodes.push_back(node);
+            }
+        }
+        for (size_t i = 0; i < top_nodes.size(); ++i) {
+            if (top_subtrees[i] < 0 && top_nodes[i].primitive_count == 0) {
+                nodes[final_ids[i]].offset = final_ids[top_nodes[i].offset];
+            }
+        }
+        if (leaf_alignment > 1) {
+            align_leaves();
+        }
+        build_sah_cost = get_sah_cost();
+        build_wide();
+    }
+
+    template<typename VB>
+    inline void bvh<VB>::align_leaves() {
+        std::vector<unsigned int> aligned_indices;
+        aligned_indices.reserve(primitive_indices.size() + nodes.size() / 2 * (leaf_alignment - 1));
+        for (auto &node: nodes) {
+            if (node.primitive_count == 0) {
+                continue;
+            }
+            auto first = primitive_indices.begin() + node.offset;
+            node.offset = static_cast<unsigned int>(aligned_indices.size());
+            aligned_indices.insert(aligned_indices.end(), first, first + node.primitive_count);
+            size_t aligned_size = (aligned_indices.size() + leaf_alignment - 1) / leaf_alignment * leaf_alignment;
+            aligned_indices.resize(aligned_size, invalid_primitive);
+        }
+        primitive_indices = std::move(aligned_indices);
+    }
+
+    template<typename VB>
+    inline unsigned int bvh<VB>::build_top_node(
+            std::vector<bvh_node<VB>> &top_nodes, std::vector<int> &top_subtrees, std::vector<subtree> &subtrees,
+            unsigned int first, unsigned int count, unsigned int depth, unsigned int subtree_size,
+            const build_input &input) {
+        unsigned int node_id = static_cast<unsigned int>(top_nodes.size());
+        top_nodes.emplace_back();
+        if (count <= subtree_size) {
+            top_subtrees.push_back(static_cast<int>(subtrees.size()));
+            subtrees.push_back({first, count, depth, {}});
+            return node_id;
+        }
+        top_subtrees.push_back(-1);
+        aabb<VB> bounds, centroid_bounds;
+        compute_bounds(first, count, input, true, bounds, centroid_bounds);
+        top_nodes[node_id].bounds = bounds;
+        unsigned int left_count = split_node(first, count, depth, bounds, centroid_bounds, input, true);
+        if (left_count == 0) {
+            top_nodes[node_id].offset = first;
+            top_nodes[node_id].primitive_count = count;
+            return node_id;
+        }
+        build_top_node(top_nodes, top_subtrees, subtrees, first, left_count, depth + 1, subtree_size, input);
+        unsigned int right = build_top_node(top_nodes, top_subtrees, subtrees, first + left_count,
+                                            count - left_count, depth + 1, subtree_size, input);
+        top_nodes[node_id].offset = right;
+        return node_id;
+    }
+
+    template<typename VB>
+    inline unsigned int bvh<VB>::build_node(
+            std::vector<bvh_node<VB>> &out_nodes, unsigned int first, unsigned int count, unsigned int depth,
+            const build_input &input) {
+        unsigned int node_id = static_cast<unsigned int>(out_nodes.size());
+        out_nodes.emplace_back();
+        aabb<VB> bounds, centroid_bounds;
+        compute_bounds(first, count, input, false, bounds, centroid_bounds);
+        out_nodes[node_id].bounds = bounds;
+        unsigned int left_count = split_node(first, count, depth, bounds, centroid_bounds, input, false);
+        if (left_count == 0) {
+            out_nodes[node_id].offset = first;
+            out_nodes[node_id].primitive_count = count;
+            return node_id;
+        }
+        build_node(out_nodes, first, left_count, depth + 1, input);
+        unsigned int right = build_node(out_nodes, first + left_count, count - left_count, depth + 1, input);
+        out_nodes[node_id].offset = right;
+        return node_id;
+    }
+
+    template<typename VB>
+    template<typename F>
+    inline void bvh<VB>::for_each_primitive(unsigned int first, unsigned int count, bool parallel, F body) {
+        int end = static_cast<int>(first + count);
+        if (!parallel) {
+            for (int i = static_cast<int>(first); i < end; ++i) {
+                body(i, 0);
+            }
+            return;
+        }
+#pragma omp parallel for
+        for (int i = static_cast<int>(first); i < end; ++i) {
+            body(i, omp_get_thread_num());
+        }
+    }
+
+    template<typename VB>
+    inline void bvh<VB>::compute_bounds(
+            unsigned int first, unsigned int count, const build_input &input, bool parallel,
+            aabb<VB> &bounds, aabb<VB> &centroid_bounds) const {
+        std::vector<aabb<VB>> thread_bounds(parallel ? 2 * omp_get_max_threads() : 2);
+        for_each_primitive(first, count, parallel, [&](int i, int thread) {
+            unsigned int primitive = primitive_indices[i];
+            thread_bounds[2 * thread].add_aabb(input.primitive_bounds[primitive]);
+            thread_bounds[2 * thread + 1].add_point(input.centroids[primitive]);
+        });
+        for (size_t i = 0; i < thread_bounds.size(); i += 2) {
+            bounds.add_aabb(thread_bounds[i]);
+            centroid_bounds.add_aabb(thread_bounds[i + 1]);
+        }
+    }
+
+    // Partitions the range and returns the number of primitives in the left child, 0 when a leaf is cheaper
+    template<typename VB>
+    inline unsigned int bvh<VB>::split_node(
+            unsigned int first, unsigned int count, unsigned int depth, const aabb<VB> &bounds,
+            const aabb<VB> &centroid_bounds, const build_input &input, bool parallel) {
+        if (count <= 1) {
+            return 0;
+        }
+        auto begin = primitive_indices.begin() + first;
+        auto end = begin + count;
+        const auto &centroids = input.centroids;
+        float3 centroid_min = centroid_bounds.get_min();
+        float3 centroid_extent = centroid_bounds.get_max() - centroid_min;
+
+        // Degenerate SAH splits may chain deeper than the traversal stack, fall back to median splits near the limit
+        unsigned int median_depth = 0;
+        while ((1u << median_depth) < count && median_depth < 32) {
+            median_depth++;
+        }
+        bool median_split = depth + median_depth >= max_depth || maxelem(centroid_extent) <= 0.0f;
+
+        float best_cost = FLT_MAX;
+        int best_axis = -1;
+        unsigned int best_bin = 0;
+        float3 bin_scale{0.0f, 0.0f, 0.0f};
+        if (!median_split) {
+            // Small nodes do not need finer bins than primitives
+            unsigned int bin_count = std::min(max_bin_count, count);
+            for (int axis = 0; axis < 3; ++axis) {
+                if (centroid_extent[axis] > 0.0f) {
+                    bin_scale[axis] = static_cast<float>(bin_count) * 0.9999f / centroid_extent[axis];
+                }
+            }
+            auto bin_id = [&centroids, &centroid_min, &bin_scale, bin_count](unsigned int primitive, int axis) {
+                float offset = (centroids[primitive][axis] - centroid_min[axis]) * bin_scale[axis];
+                return std::min(static_cast<unsigned int>(offset), bin_count - 1);
+            };
+            std::vector<bin> thread_bins((parallel ? omp_get_max_threads() : 1) * 3 * bin_count);
+            for_each_primitive(first, count, parallel, [&](int i, int thread) {
+                unsigned int primitive = primitive_indices[i];
+                bin *bins = &thread_bins[thread * 3 * bin_count];
+                for (int axis = 0; axis < 3; ++axis) {
+                    bin &target = bins[axis * bin_count + bin_id(primitive, axis)];
+                    target.bounds.add_aabb(input.primitive_bounds[primitive]);
+                    target.count++;
+                }
+            });
+            for (size_t i = 3 * bin_count; i < thread_bins.size(); ++i) {
+                thread_bins[i % (3 * bin_count)].bounds.add_aabb(thread_bins[i].bounds);
+                thread_bins[i % (3 * bin_count)].count += thread_bins[i].count;
+            }
+
+            // Sweep the planes between the bins of every axis
+            for (int axis = 0; axis < 3; ++axis) {
+                if (centroid_extent[axis] <= 0.0f) {
+                    continue;
+                }
+                const bin *bins = &thread_bins[axis * bin_count];
+                float right_areas[max_bin_count];
+                unsigned int right_counts[max_bin_count];
+                aabb<VB> right_bounds;
+                unsigned int right_count = 0;
+                for (unsigned int i = bin_count - 1; i > 0; --i) {
+                    right_bounds.add_aabb(bins[i].bounds);
+                    right_count += bins[i].count;
+                    right_areas[i] = right_bounds.get_surface_area();
+                    right_counts[i] = right_count;
+                }
+                aabb<VB> left_bounds;
+                unsigned int left_count = 0;
+                for (unsigned int i = 1; i < bin_count; ++i) {
+                    left_bounds.add_aabb(bins[i - 1].bounds);
+                    left_count += bins[i - 1].count;
+                    if (left_count == 0 || right_counts[i] == 0) {
+                        continue;
+                    }
+                    float cost = left_bounds.get_surface_area() * get_leaf_cost(left_count) +
+                                 right_areas[i] * get_leaf_cost(right_counts[i]);
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_bin = i;
+                    }
+                }
+            }
+            float leaf_cost = get_leaf_cost(count);
+            best_cost = traversal_cost + best_cost / std::max(bounds.get_surface_area(), FLT_MIN);
+            if (count <= get_max_leaf_size() && (best_axis < 0 || leaf_cost <= best_cost)) {
+                return 0;
+            }
+            if (best_axis >= 0) {
+                auto middle = std::partition(begin, end, [&bin_id, best_axis, best_bin](unsigned int primitive) {
+                    return bin_id(primitive, best_axis) < best_bin;
+                });
+                return static_cast<unsigned int>(middle - begin);
+            }
+        }
+        if (count <= get_max_leaf_size()) {
+            return 0;
+        }
+        int axis = centroid_bounds.get_largest_axis();
+        std::nth_element(begin, begin + count / 2, end, [&centroids, axis](unsigned int a, unsigned int b) {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+        return count / 2;
+    }
+
+    // Leaves are refitted in parallel, then the interior nodes bottom-up: children always follow their parent
+    template<typename VB>
+    inline void bvh<VB>::refit(const std::vector<aabb<VB>> &primitive_bounds) {
+        int node_count = static_cast<int>(nodes.size());
+#pragma omp parallel for
+        for (int i = 0; i < node_count; ++i) {
+            auto &node = nodes[i];
+            if (node.primitive_count > 0) {
+                node.bounds = aabb<VB>();
+                for (unsigned int j = node.offset; j < node.offset + node.primitive_count; ++j) {
+                    node.bounds.add_aabb(primitive_bounds[primitive_indices[j]]);
+                }
+            }
+        }
+        for (int i = node_count - 1; i >= 0; --i) {
+            auto &node = nodes[i];
+            if (node.primitive_count == 0) {
+                node.bounds = nodes[i + 1].bounds;
+                node.bounds.add_aabb(nodes[node.offset].bounds);
+            }
+        }
+        build_wide();
+    }
+
+    template<typename VB>
+    inline void bvh<VB>::set_width(unsigned int in_width) {
+        if (in_width != 2 && in_width != 4 && in_width != 8) {
+            THROW_ERROR("BVH width has to be 2, 4 or 8");
+        }
+        if (in_width == width) {
+            return;
+        }
+        width = in_width;
+        build_wide();
+    }
+
+    template<typename VB>
+    inline unsigned int bvh<VB>::get_width() const {
+        return width;
+    }
+
+    template<typename VB>
+    inline void bvh<VB>::build_wide() {
+        bvh4 = wide_bvh<VB, 4>();
+        bvh8 = wide_bvh<VB, 8>();
+        if (width == 4) {
+            bvh4.build(*this);
+        }
+        else if (width == 8) {
+            bvh8.build(*this);
+        }
+    }
+
+    template<typename VB>
+    inline const wide_bvh<VB, 4> &bvh<VB>::get_bvh4() const {
+        return bvh4;
+    }
+
+    template<typename VB>
+    inline const wide_bvh<VB, 8> &bvh<VB>::get_bvh8() const {
+        return bvh8;
+    }
+
+    template<typename VB, unsigned int N>
+    inline void wide_bvh<VB, N>::build(const bvh<VB> &binary) {
+        nodes.clear();
+        if (binary.get_nodes().empty()) {
+            return;
+        }
+        nodes.reserve(binary.get_nodes().size() / 2 + 1);
+        collapse_node(binary.get_nodes(), 0);
+    }
+
+    template<typename VB, unsigned int N>
+    inline unsigned int wide_bvh<VB, N>::collapse_node(
+            const std::vector<bvh_node<VB>> &binary_nodes, unsigned int binary_node_id) {
+        // Open the interior child with the largest surface area until all N slots are taken
+        unsigned int children[N];
+        unsigned int child_count = 0;
+        if (binary_nodes[binary_node_id].primitive_count > 0) {
+            children[child_count++] = binary_node_id;
+        }
+        else {
+            children[child_count++] = binary_node_id + 1;
+            children[child_count++] = binary_nodes[binary_node_id].offset;
+        }
+        while (child_count < N) {
+            int largest = -1;
+            float largest_area = -1.0f;
+            for (unsigned int i = 0; i < child_count; ++i) {
+                const auto &child = binary_nodes[children[i]];
+                if (child.primitive_count == 0 && child.bounds.get_surface_area() > largest_area) {
+                    largest = static_cast<int>(i);
+                    largest_area = child.bounds.get_surface_area();
+                }
+            }
+            if (largest < 0) {
+                break;
+            }
+            unsigned int opened = children[largest];
+            children[largest] = opened + 1;
+            children[child_count++] = binary_nodes[opened].offset;
+        }
+
+        unsigned int node_id = static_cast<unsigned int>(nodes.size());
+        nodes.emplace_back();
+        for (unsigned int i = 0; i < N; ++i) {
+            auto &node = nodes[node_id];
+            if (i >= child_count) {
+                node.min_x[i] = node.min_y[i] = node.min_z[i] = FLT_MAX;
+                node.max_x[i] = node.max_y[i] = node.max_z[i] = FLT_MAX;
+                node.child[i] = 0;
+                node.primitive_count[i] = 0;
+                continue;
+            }
+            const auto &child = binary_nodes[children[i]];
+            node.min_x[i] = child.bounds.get_min().x;
+            node.min_y[i] = child.bounds.get_min().y;
+            node.min_z[i] = child.bounds.get_min().z;
+            node.max_x[i] = child.bounds.get_max().x;
+            node.max_y[i] = child.bounds.get_max().y;
+            node.max_z[i] = child.bounds.get_max().z;
+            node.primitive_count[i] = child.primitive_count;
+            node.child[i] = child.offset;
+        }
+        for (unsigned int i = 0; i < child_count; ++i) {
+            if (binary_nodes[children[i]].primitive_count == 0) {
+                unsigned int child_id = collapse_node(binary_nodes, children[i]);
+                nodes[node_id].child[i] = child_id;
+            }
+        }
+        return node_id;
+    }
+
+    template<typename VB, unsigned int N>
+    inline const std::vector<wide_bvh_node<VB, N>> &wide_bvh<VB, N>::get_nodes() const {
+        return nodes;
+    }
+
+#ifdef CG_SIMD_X86
+    inline unsigned int intersect_4_sse(
+            const float *bounds, size_t stride, const ray &ray, const float3 &inv_ray_direction, float max_t,
+            float *t_near) {
+        __m128 position_x = _mm_set1_ps(ray.position.x);
+        __m128 position_y = _mm_set1_ps(ray.position.y);
+        __m128 position_z = _mm_set1_ps(ray.position.z);
+        __m128 inv_x = _mm_set1_ps(inv_ray_direction.x);
+        __m128 inv_y = _mm_set1_ps(inv_ray_direction.y);
+        __m128 inv_z = _mm_set1_ps(inv_ray_direction.z);
+        __m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds), position_x), inv_x);
+        __m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds + stride), position_y), inv_y);
+        __m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds + 2 * stride), position_z), inv_z);
+        __m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds + 3 * stride), position_x), inv_x);
+        __m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds + 4 * stride), position_y), inv_y);
+        __m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds + 5 * stride), position_z), inv_z);
+        __m128 t_min = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)),
+                                  _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+        __m128 t_max = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)),
+                                  _mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(max_t)));
+        _mm_storeu_ps(t_near, t_min);
+        return static_cast<unsigned int>(_mm_movemask_ps(_mm_cmple_ps(t_min, t_max)));
+    }
+
+    CG_TARGET_AVX2 inline unsigned int intersect_8_avx2(
+            const float *bounds, const ray &ray, const float3 &inv_ray_direction, float max_t, float *t_near) {
+        __m256 position_x = _mm256_set1_ps(ray.position.x);
+        __m256 position_y = _mm256_set1_ps(ray.position.y);
+        __m256 position_z = _mm256_set1_ps(ray.position.z);
+        __m256 inv_x = _mm256_set1_ps(inv_ray_direction.x);
+        __m256 inv_y = _mm256_set1_ps(inv_ray_direction.y);
+        __m256 inv_z = _mm256_set1_ps(inv_ray_direction.z);
+        __m256 x0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds), position_x), inv_x);
+        __m256 y0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds + 8), position_y), inv_y);
+        __m256 z0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds + 16), position_z), inv_z);
+        __m256 x1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds + 24), position_x), inv_x);
+        __m256 y1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds + 32), position_y), inv_y);
+        __m256 z1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds + 40), position_z), inv_z);
+        __m256 t_min = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(x0, x1), _mm256_min_ps(y0, y1)),
+                                     _mm256_max_ps(_mm256_min_ps(z0, z1), _mm256_setzero_ps()));
+        __m256 t_max = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(x0, x1), _mm256_max_ps(y0, y1)),
+                                     _mm256_min_ps(_mm256_max_ps(z0, z1), _mm256_set1_ps(max_t)));
+        _mm256_storeu_ps(t_near, t_min);
+        return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(t_min, t_max, _CMP_LE_OQ)));
+    }
+#endif
+
+    template<typename VB, unsigned int N>
+    inline unsigned int wide_bvh_node<VB, N>::intersect(
+            const ray &ray, const float3 &inv_ray_direction, float max_t, float *t_near) const {
+#ifdef CG_SIMD_X86
+        if (N == 8 && simd::has_avx2()) {
+            return intersect_8_avx2(min_x, ray, inv_ray_direction, max_t, t_near);
+        }
+        unsigned int hit_mask = 0;
+        for (unsigned int i = 0; i < N; i += 4) {
+            hit_mask |= intersect_4_sse(min_x + i, N, ray, inv_ray_direction, max_t, t_near + i) << i;
+        }
+        return hit_mask;
+#else
+        unsigned int hit_mask = 0;
+        for (unsigned int i = 0; i < N; ++i) {
+            float3 r0 = (float3{min_x[i], min_y[i], min_z[i]} - ray.position) * inv_ray_direction;
+            float3 r1 = (float3{max_x[i], max_y[i], max_z[i]} - ray.position) * inv_ray_direction;
+            t_near[i] = std::max(maxelem(min(r0, r1)), 0.0f);
+            if (t_near[i] <= std::min(minelem(max(r0, r1)), max_t)) {
+                hit_mask |= 1u << i;
+            }
+        }
+        return hit_mask;
+#endif
+    }
+
+    inline void pixel_variance::add(float value) {
+        samples++;
+        float delta = value - mean;
+        mean += delta / static_cast<float>(samples);
+        m2 += delta * (value - mean);
+    }
+
+    inline void pixel_variance::merge(const pixel_variance &other) {
+        if (other.samples == 0) {
+            return;
+        }
+        unsigned int total = samples + other.samples;
+        float delta = other.mean - mean;
+        float other_share = static_cast<float>(other.samples) / static_cast<float>(total);
+        mean += delta * other_share;
+        m2 += other.m2 + delta * delta * static_cast<float>(samples) * other_share;
+        samples = total;
+    }
+
+    inline float pixel_variance::get_relative_error() const {
+        if (samples < 2) {
+            return FLT_MAX;
+        }
+        float standard_error = std::sqrt(m2 / static_cast<float>(samples - 1) / static_cast<float>(samples));
+        // Black pixels with no variance are converged, the floor keeps dark noisy ones from dividing by zero
+        return standard_error / std::max(mean, 1e-3f);
+    }
+
+    inline float pixel_variance::get_mean_variance() const {
+        if (samples < 2) {
+            return mean * mean;
+        }
+        return m2 / static_cast<float>(samples - 1) / static_cast<float>(samples);
+    }
+
+    inline void ray_queue::clear() {
+        for (int axis = 0; axis < 3; ++axis) {
+            position[axis].clear();
+            direction[axis].clear();
+            weight[axis].clear();
+        }
+        pixel.clear();
+        pdf.clear();
+        samplers.clear();
+    }
+
+    inline void ray_queue::push(const ray &ray, unsigned int ray_pixel, const float3 &ray_weight, float ray_pdf,
+                                const sampler &ray_sampler) {
+        for (int axis = 0; axis < 3; ++axis) {
+            position[axis].push_back(ray.position[axis]);
+            direction[axis].push_back(ray.direction[axis]);
+            weight[axis].push_back(ray_weight[axis]);
+        }
+        pixel.push_back(ray_pixel);
+        pdf.push_back(ray_pdf);
+        samplers.push_back(ray_sampler);
+    }
+
+    inline size_t ray_queue::size() const {
+        return pixel.size();
+    }
+
+    inline ray ray_queue::get_ray(size_t i) const {
+        // Directions are stored normalized already, normalizing them again could change the last bits
+        ray result(float3{position[0][i], position[1][i], position[2][i]}, float3{0.0f, 0.0f, 1.0f});
+        result.direction = float3{direction[0][i], direction[1][i], direction[2][i]};
+        return result;
+    }
+
+    inline float3 ray_queue::get_weight(size_t i) const {
+        return float3{weight[0][i], weight[1][i], weight[2][i]};
+    }
+
+    // Interleaves the low 10 bits of x, y and z
+    inline uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z) {
+        auto spread = [](uint32_t value) {
+            value = (value | (value << 16)) & 0x030000FF;
+            value = (value | (value << 8)) & 0x0300F00F;
+            value = (value | (value << 4)) & 0x030C30C3;
+            value = (value | (value << 2)) & 0x09249249;
+            return value;
+        };
+        return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+    }
+
+    inline uint64_t morton_code_2d(uint32_t x, uint32_t y) {
+        auto spread = [](uint64_t value) {
+            value = (value | (value << 16)) & 0x0000FFFF0000FFFFull;
+            value = (value | (value << 8)) & 0x00FF00FF00FF00FFull;
+            value = (value | (value << 4)) & 0x0F0F0F0F0F0F0F0Full;
+            value = (value | (value << 2)) & 0x3333333333333333ull;
+            value = (value | (value << 1)) & 0x5555555555555555ull;
+            return value;
+        };
+        return spread(x) | (spread(y) << 1);
+    }
+
+    inline std::vector<unsigned int> sort_by_key(const std::vector<uint32_t> &keys, unsigned int key_bits) {
+        constexpr unsigned int digit_bits = 10;
+        constexpr uint32_t digit_mask = (1u << digit_bits) - 1;
+        std::vector<unsigned int> order(keys.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::vector<unsigned int> sorted(keys.size());
+        std::vector<unsigned int> offsets(1u << digit_bits);
+        for (unsigned int shift = 0; shift < key_bits; shift += digit_bits) {
+            std::fill(offsets.begin(), offsets.end(), 0);
+            for (uint32_t key: keys) {
+                offsets[(key >> shift) & digit_mask]++;
+            }
+            unsigned int offset = 0;
+            for (auto &digit_offset: offsets) {
+                unsigned int count = digit_offset;
+                digit_offset = offset;
+                offset += count;
+            }
+            for (unsigned int index: order) {
+                sorted[offsets[(keys[index] >> shift) & digit_mask]++] = index;
+            }
+            order.swap(sorted);
+        }
+        return order;
+    }
+
+    inline void ray_queue::sort(const float3 &scene_min, const float3 &scene_max) {
+        // 9 bits per axis and the octant fill 30 bits, three passes of the radix sort
+        constexpr unsigned int cell_bits = 9;
+        constexpr float grid_size = static_cast<float>(1u << cell_bits);
+        float3 cell_scale = float3(grid_size) / max(scene_max - scene_min, float3(FLT_MIN));
+        std::vector<uint32_t> keys(size());
+        for (size_t i = 0; i < size(); ++i) {
+            uint32_t cell[3];
+            uint32_t octant = 0;
+            for (int axis = 0; axis < 3; ++axis) {
+                float offset = (position[axis][i] - scene_min[axis]) * cell_scale[axis];
+                cell[axis] = static_cast<uint32_t>(std::min(std::max(offset, 0.0f), grid_size - 1.0f));
+                octant |= (direction[axis][i] < 0.0f ? 1u : 0u) << axis;
+            }
+            keys[i] = octant << (3 * cell_bits) | morton_code(cell[0], cell[1], cell[2]);
+        }
+        std::vector<unsigned int> order = sort_by_key(keys, 3 * cell_bits + 3);
+        auto reorder = [&](auto &values) {
+            auto sorted = values;
+            for (size_t i = 0; i < order.size(); ++i) {
+                sorted[i] = values[order[i]];
+            }
+            values.swap(sorted);
+        };
+        for (int axis = 0; axis < 3; ++axis) {
+            reorder(position[axis]);
+            reorder(direction[axis]);
+            reorder(weight[axis]);
+        }
+        reorder(pixel);
+        reorder(pdf);
+        reorder(samplers);
+    }
+
+    inline void ray_packet::set_ray(unsigned int i, const float3 &ray_direction, float ray_min_t, float ray_max_t) {
+        for (int axis = 0; axis < 3; ++axis) {
+            direction[axis][i] = ray_direction[axis];
+            inv_direction[axis][i] = 1.0f / ray_direction[axis];
+        }
+        min_t[i] = ray_min_t;
+        max_t[i] = ray_max_t;
+        u[i] = 0.0f;
+        v[i] = 0.0f;
+        triangle[i] = -1;
+    }
+
+    inline void ray_packet::set_count(unsigned int in_count) {
+        count = (in_count + group_size - 1) / group_size * group_size;
+        for (unsigned int i = in_count; i < count; ++i) {
+            set_ray(i, float3{direction[0][in_count - 1], direction[1][in_count - 1], direction[2][in_count - 1]},
+                    0.0f, -1.0f);
+        }
+    }
+
+    inline float ray_packet::get_max_t() const {
+        float result = -1.0f;
+        for (unsigned int i = 0; i < count; ++i) {
+            result = std::max(result, max_t[i]);
+        }
+        return result;
+    }
+
+    // Same slab test as aabb::aabb_test, one ray per lane
+    inline unsigned int ray_packet::intersect_box(
+            unsigned int first, const float3 &box_min, const float3 &box_max) const {
+#ifdef CG_SIMD_X86
+        if (simd::get_isa() != simd::isa::scalar) {
+            __m128 t_near = _mm_setzero_ps();
+            __m128 t_far = _mm_load_ps(max_t + first);
+            for (int axis = 0; axis < 3; ++axis) {
+                __m128 o = _mm_set1_ps(origin[axis]);
+                __m128 inv = _mm_load_ps(inv_direction[axis] + first);
+                __m128 r0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box_max[axis]), o), inv);
+                __m128 r1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box_min[axis]), o), inv);
+                t_near = _mm_max_ps(t_near, _mm_min_ps(r0, r1));
+                t_far = _mm_min_ps(t_far, _mm_max_ps(r0, r1));
+            }
+            return static_cast<unsigned int>(_mm_movemask_ps(_mm_cmple_ps(t_near, t_far)));
+        }
+#endif
+        unsigned int hit_mask = 0;
+        for (unsigned int i = 0; i < group_size; ++i) {
+            float t_near = 0.0f;
+            float t_far = max_t[first + i];
+            for (int axis = 0; axis < 3; ++axis) {
+                float r0 = (box_max[axis] - origin[axis]) * inv_direction[axis][first + i];
+                float r1 = (box_min[axis] - origin[axis]) * inv_direction[axis][first + i];
+                t_near = std::max(t_near, std::min(r0, r1));
+                t_far = std::min(t_far, std::max(r0, r1));
+            }
+            if (t_near <= t_far) {
+                hit_mask |= 1u << i;
+            }
+        }
+        return hit_mask;
+    }
+
+    // The operations of intersect_triangles_4 with the roles swapped: one triangle, a ray per lane. The
+    // vectors that only depend on the shared origin are computed once per triangle.
+    inline void ray_packet::intersect_triangle(
+            unsigned int group_mask, const float3 &a, const float3 &ba, const float3 &ca, int triangle_id) {
+        float tx = origin.x - a.x;
+        float ty = origin.y - a.y;
+        float tz = origin.z - a.z;
+        float qx = ty * ba.z - tz * ba.y;
+        float qy = tz * ba.x - tx * ba.z;
+        float qz = tx * ba.y - ty * ba.x;
+        float t_q = ca.x * qx + ca.y * qy + ca.z * qz;
+#ifdef CG_SIMD_X86
+        if (simd::get_isa() != simd::isa::scalar) {
+            __m128 bax = _mm_set1_ps(ba.x);
+            __m128 bay = _mm_set1_ps(ba.y);
+            __m128 baz = _mm_set1_ps(ba.z);
+            __m128 cax = _mm_set1_ps(ca.x);
+            __m128 cay = _mm_set1_ps(ca.y);
+            __m128 caz = _mm_set1_ps(ca.z);
+            __m128 zero = _mm_setzero_ps();
+            __m128 one = _mm_set1_ps(1.0f);
+            for (unsigned int first = 0; first < count; first += group_size) {
+                if (!(group_mask & (1u << (first / group_size)))) {
+                    continue;
+                }
+                __m128 dx = _mm_load_ps(direction[0] + first);
+                __m128 dy = _mm_load_ps(direction[1] + first);
+                __m128 dz = _mm_load_ps(direction[2] + first);
+                __m128 px = _mm_sub_ps(_mm_mul_ps(dy, caz), _mm_mul_ps(dz, cay));
+                __m128 py = _mm_sub_ps(_mm_mul_ps(dz, cax), _mm_mul_ps(dx, caz));
+                __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, cay), _mm_mul_ps(dy, cax));
+                __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(bax, px), _mm_mul_ps(bay, py)), _mm_mul_ps(baz, pz));
+                __m128 inv_det = _mm_div_ps(one, det);
+                __m128 u4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(tx), px), _mm_mul_ps(_mm_set1_ps(ty), py)),
+                                                  _mm_mul_ps(_mm_set1_ps(tz), pz)),
+                                       inv_det);
+                __m128 v4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(qx)), _mm_mul_ps(dy, _mm_set1_ps(qy))),
+                                                  _mm_mul_ps(dz, _mm_set1_ps(qz))),
+                                       inv_det);
+                __m128 t4 = _mm_mul_ps(_mm_set1_ps(t_q), inv_det);
+                __m128 degenerate = _mm_and_ps(_mm_cmpgt_ps(det, _mm_set1_ps(-triangle_epsilon)),
+                                               _mm_cmplt_ps(det, _mm_set1_ps(triangle_epsilon)));
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u4, zero), _mm_cmple_ps(u4, one)),
+                                           _mm_and_ps(_mm_cmpge_ps(v4, zero), _mm_cmple_ps(_mm_add_ps(u4, v4), one)));
+                __m128 old_max_t = _mm_load_ps(max_t + first);
+                __m128 in_range = _mm_and_ps(_mm_cmpgt_ps(t4, _mm_load_ps(min_t + first)), _mm_cmplt_ps(t4, old_max_t));
+                __m128 hit = _mm_andnot_ps(degenerate, _mm_and_ps(inside, in_range));
+                if (_mm_movemask_ps(hit) == 0) {
+                    continue;
+                }
+                auto blend = [&](__m128 new_value, __m128 old_value) {
+                    return _mm_or_ps(_mm_and_ps(hit, new_value), _mm_andnot_ps(hit, old_value));
+                };
+                _mm_store_ps(max_t + first, blend(t4, old_max_t));
+                _mm_store_ps(u + first, blend(u4, _mm_load_ps(u + first)));
+                _mm_store_ps(v + first, blend(v4, _mm_load_ps(v + first)));
+                __m128 old_triangle = _mm_castsi128_ps(_mm_load_si128(reinterpret_cast<const __m128i *>(triangle + first)));
+                __m128 new_triangle = _mm_castsi128_ps(_mm_set1_epi32(triangle_id));
+                _mm_store_si128(reinterpret_cast<__m128i *>(triangle + first), _mm_castps_si128(blend(new_triangle, old_triangle)));
+            }
+            return;
+        }
+#endif
+        for (unsigned int i = 0; i < count; ++i) {
+            if (!(group_mask & (1u << (i / group_size)))) {
+                continue;
+            }
+            float dx = direction[0][i];
+            float dy = direction[1][i];
+            float dz = direction[2][i];
+            float px = dy * ca.z - dz * ca.y;
+            float py = dz * ca.x - dx * ca.z;
+            float pz = dx * ca.y - dy * ca.x;
+            float det = ba.x * px + ba.y * py + ba.z * pz;
+            float inv_det = 1.0f / det;
+            float hit_u = (tx * px + ty * py + tz * pz) * inv_det;
+            float hit_v = (dx * qx + dy * qy + dz * qz) * inv_det;
+            float hit_t = t_q * inv_det;
+            bool degenerate = det > -triangle_epsilon && det < triangle_epsilon;
+            if (!degenerate && hit_u >= 0.0f && hit_u <= 1.0f && hit_v >= 0.0f && hit_u + hit_v <= 1.0f &&
+                hit_t > min_t[i] && hit_t < max_t[i]) {
+                max_t[i] = hit_t;
+                u[i] = hit_u;
+                v[i] = hit_v;
+                triangle[i] = triangle_id;
+            }
+        }
+    }
+
+    inline bool ray_frustum::init(const ray_packet &packet) {
+        for (int axis = 0; axis < 3; ++axis) {
+            sign[axis] = packet.direction[axis][0] < 0.0f ? -1.0f : 1.0f;
+            float min_direction = FLT_MAX;
+            float max_direction = 0.0f;
+            for (unsigned int i = 0; i < packet.count; ++i) {
+                float direction = packet.direction[axis][i] * sign[axis];
+                min_direction = std::min(min_direction, direction);
+                max_direction = std::max(max_direction, direction);
+            }
+            if (min_direction <= 0.0f) {
+                return false;
+            }
+            inv_min[axis] = 1.0f / max_direction;
+            inv_max[axis] = 1.0f / min_direction;
+        }
+        origin = packet.origin * sign;
+        return true;
+    }
+
+    template<typename VB>
+    inline bool ray_frustum::intersect(const aabb<VB> &box, float max_t, float &t_near) const {
+        float t_far = max_t;
+        t_near = 0.0f;
+        for (int axis = 0; axis < 3; ++axis) {
+            float near_plane = sign[axis] > 0.0f ? box.get_min()[axis] : -box.get_max()[axis];
+            float far_plane = sign[axis] > 0.0f ? box.get_max()[axis] : -box.get_min()[axis];
+            float near_distance = near_plane - origin[axis];
+            float far_distance = far_plane - origin[axis];
+            t_near = std::max(t_near, near_distance * (near_distance >= 0.0f ? inv_min[axis] : inv_max[axis]));
+            t_far = std::min(t_far, far_distance * (far_distance >= 0.0f ? inv_max[axis] : inv_min[axis]));
+        }
+        return t_near <= t_far;
+    }
+
+    template<typename VB>
+    inline void bvh<VB>::set_leaf_alignment(unsigned int in_leaf_alignment) {
+        leaf_alignment = in_leaf_alignment;
+    }
+
+    template<typename VB>
+    inline float bvh<VB>::get_leaf_cost(unsigned int count) const {
+        return intersection_cost * static_cast<float>((count + leaf_alignment - 1) / leaf_alignment);
+    }
+
+    template<typename VB>
+    inline unsigned int bvh<VB>::get_max_leaf_size() const {
+        return std::max(max_leaf_size, 2 * leaf_alignment);
+    }
+
+    template<typename VB>
+    inline const std::vector<bvh_node<VB>> &bvh<VB>::get_nodes() const {
+        return nodes;
+    }
+
+    template<typename VB>
+    inline const std::vector<unsigned int> &bvh<VB>::get_primitive_indices() const {
+        return primitive_indices;
+    }
+
+    // Expected cost of a random ray hitting the root, primitives cost intersection_cost unless given explicitly
+    template<typename VB>
+    inline float bvh<VB>::get_sah_cost(const std::vector<float> &primitive_costs) const {
+        if (nodes.empty()) {
+            return 0.0f;
+        }
+        float root_area = std::max(nodes[0].bounds.get_surface_area(), FLT_MIN);
+        float cost = 0.0f;
+        for (const auto &node: nodes) {
+            float probability = node.bounds.get_surface_area() / root_area;
+            if (node.primitive_count == 0) {
+                cost += probability * traversal_cost;
+                continue;
+            }
+            for (unsigned int i = node.offset; i < node.offset + node.primitive_count; ++i) {
+                cost += probability * (primitive_costs.empty() ? intersection_cost : primitive_costs[primitive_indices[i]]);
+            }
+        }
+        return cost;
+    }
+
+    template<typename VB>
+    inline void blas<VB>::build(std::vector<triangle<VB>> in_triangles, unsigned int bvh_width) {
+        tree.set_width(bvh_width);
+        tree.set_leaf_alignment(triangle_packet::width);
+        tree.build(get_triangle_bounds(in_triangles));
+        set_triangles(in_triangles);
+    }
+
+    template<typename VB>
+    inline bool blas<VB>::refit(std::vector<triangle<VB>> in_triangles, float rebuild_threshold) {
+        if (in_triangles.size() != triangle_count) {
+            build(std::move(in_triangles), tree.get_width());
+            return true;
+        }
+        tree.refit(get_triangle_bounds(in_triangles));
+        if (tree.is_degraded(rebuild_threshold)) {
+            build(std::move(in_triangles), tree.get_width());
+            return true;
+        }
+        set_triangles(in_triangles);
+        return false;
+    }
+
+    template<typename VB>
+    inline void blas<VB>::set_triangles(const std::vector<triangle<VB>> &in_triangles) {
+        const auto &primitive_indices = tree.get_primitive_indices();
+        packets.assign(primitive_indices.size() / triangle_packet::width, triangle_packet{});
+        shading.assign(primitive_indices.size(), triangle_shading{});
+        int slot_count = static_cast<int>(primitive_indices.size());
+#pragma omp parallel for
+        for (int slot = 0; slot < slot_count; ++slot) {
+            unsigned int primitive = primitive_indices[slot];
+            if (primitive == bvh<VB>::invalid_primitive) {
+                continue;
+            }
+            const auto &source = in_triangles[primitive];
+            auto &packet = packets[slot / triangle_packet::width];
+            unsigned int lane = slot % triangle_packet::width;
+            for (int axis = 0; axis < 3; ++axis) {
+                packet.a[axis][lane] = source.a[axis];
+                packet.ba[axis][lane] = source.ba[axis];
+                packet.ca[axis][lane] = source.ca[axis];
+            }
+            shading[slot] = {source.b, source.c, source.na, source.nb, source.nc,
+                             source.ambient, source.diffuse, source.emissive};
+        }
+        triangle_count = in_triangles.size();
+    }
+
+    template<typename VB>
+    inline void blas<VB>::save(std::ostream &stream) const {
+        tree.save(stream);
+        write_cache_vector(stream, packets);
+        write_cache_vector(stream, shading);
+    }
+
+    template<typename VB>
+    inline bool blas<VB>::load(const char *&data, const char *end) {
+        if (!tree.load(data, end) || !read_cache_vector(data, end, packets) ||
+            !read_cache_vector(data, end, shading)) {
+            return false;
+        }
+        const auto &primitive_indices = tree.get_primitive_indices();
+        triangle_count = primitive_indices.size() - std::count(
+                primitive_indices.begin(), primitive_indices.end(), bvh<VB>::invalid_primitive);
+        return packets.size() * triangle_packet::width == primitive_indices.size() &&
+               shading.size() == primitive_indices.size();
+    }
+
+    template<typename VB>
+    inline std::vector<aabb<VB>> blas<VB>::get_triangle_bounds(const std::vector<triangle<VB>> &in_triangles) {
+        std::vector<aabb<VB>> triangle_bounds(in_triangles.size());
+        int triangle_count = static_cast<int>(in_triangles.size());
+#pragma omp parallel for
+        for (int i = 0; i < triangle_count; ++i) {
+            triangle_bounds[i].add_triangle(in_triangles[i]);
+        }
+        return triangle_bounds;
+    }
+
+    template<typename VB>
+    inline void blas<VB>::set_bvh_width(unsigned int in_width) {
+        tree.set_width(in_width);
+    }
+
+    template<typename VB>
+    inline const bvh<VB> &blas<VB>::get_bvh() const {
+        return tree;
+    }
+
+    template<typename VB>
+    inline const std::vector<triangle_packet> &blas<VB>::get_packets() const {
+        return packets;
+    }
+
+    template<typename VB>
+    inline void blas<VB>::prefetch_shading(unsigned int slot) const {
+        simd::prefetch(&shading[slot]);
+    }
+
+    template<typename VB>
+    inline size_t blas<VB>::get_triangle_count() const {
+        return triangle_count;
+    }
+
+    template<typename VB>
+    inline triangle<VB> blas<VB>::get_triangle(unsigned int slot) const {
+        triangle<VB> result;
+        const auto &packet = packets[slot / triangle_packet::width];
+        unsigned int lane = slot % triangle_packet::width;
+        const auto &cold = shading[slot];
+        result.a = float3{packet.a[0][lane], packet.a[1][lane], packet.a[2][lane]};
+        result.ba = float3{packet.ba[0][lane], packet.ba[1][lane], packet.ba[2][lane]};
+        result.ca = float3{packet.ca[0][lane], packet.ca[1][lane], packet.ca[2][lane]};
+        result.b = cold.b;
+        result.c = cold.c;
+        result.na = cold.na;
+        result.nb = cold.nb;
+        result.nc = cold.nc;
+        result.ambient = cold.ambient;
+        result.diffuse = cold.diffuse;
+        result.emissive = cold.emissive;
+        return result;
+    }
+
+    template<typename VB>
+    inline aabb<VB> blas<VB>::get_bounds() const {
+        if (tree.get_nodes().empty()) {
+            return aabb<VB>();
+        }
+        return tree.get_nodes()[0].bounds;
+    }
+
+    template<typename VB>
+    inline triangle<VB> instance<VB>::to_world(const triangle<VB> &triangle) const {
+        cg::renderer::triangle<VB> result = triangle;
+        float4x4 normal_matrix = transpose(inverse_world_matrix);
+        result.a = mul(world_matrix, float4{triangle.a, 1.0f}).xyz();
+        result.b = mul(world_matrix, float4{triangle.b, 1.0f}).xyz();
+        result.c = mul(world_matrix, float4{triangle.c, 1.0f}).xyz();
+        result.ba = result.b - result.a;
+        result.ca = result.c - result.a;
+        result.na = normalize(mul(normal_matrix, float4{triangle.na, 0.0f}).xyz());
+        result.nb = normalize(mul(normal_matrix, float4{triangle.nb, 0.0f}).xyz());
+        result.nc = normalize(mul(normal_matrix, float4{triangle.nc, 0.0f}).xyz());
+        return result;
+    }
+
+    template<typename VB>
+    inline void tlas<VB>::set_mesh(unsigned int mesh_id, std::vector<triangle<VB>> in_triangles) {
+        if (mesh_id >= meshes.size()) {
+            meshes.resize(mesh_id + 1);
+        }
+        meshes[mesh_id].build(std::move(in_triangles), bvh_width);
+    }
+
+    template<typename VB>
+    inline bool tlas<VB>::refit_mesh(unsigned int mesh_id, std::vector<triangle<VB>> in_triangles) {
+        if (mesh_id >= meshes.size()) {
+            set_mesh(mesh_id, std::move(in_triangles));
+            return true;
+        }
+        return meshes[mesh_id].refit(std::move(in_triangles), rebuild_threshold);
+    }
+
+    template<typename VB>
+    inline unsigned int tlas<VB>::add_instance(unsigned int mesh_id, const float4x4 &world_matrix) {
+        instances.push_back({mesh_id, world_matrix, inverse(world_matrix)});
+        return static_cast<unsigned int>(instances.size() - 1);
+    }
+
+    template<typename VB>
+    inline void tlas<VB>::set_instance_transform(unsigned int instance_id, const float4x4 &world_matrix) {
+        auto &instance = instances[instance_id];
+        instance.world_matrix = world_matrix;
+        instance.inverse_world_matrix = inverse(world_matrix);
+        if (!tree.get_nodes().empty()) {
+            refit();
+        }
+    }
+
+    template<typename VB>
+    inline void tlas<VB>::build() {
+        tree.set_width(bvh_width);
+        tree.build(get_instance_bounds());
+    }
+
+    template<typename VB>
+    inline void tlas<VB>::refit() {
+        if (tree.get_primitive_indices().size() != instances.size()) {
+            build();
+            return;
+        }
+        tree.refit(get_instance_bounds());
+        if (tree.is_degraded(rebuild_threshold)) {
+            build();
+        }
+    }
+
+    template<typename VB>
+    inline void tlas<VB>::set_bvh_width(unsigned int in_width) {
+        bvh_width = in_width;
+        tree.set_width(in_width);
+        for (auto &mesh: meshes) {
+            mesh.set_bvh_width(in_width);
+        }
+    }
+
+    template<typename VB>
+    inline float bvh<VB>::get_build_sah_cost() const {
+        return build_sah_cost;
+    }
+
+    template<typename VB>
+    inline bool bvh<VB>::is_degraded(float rebuild_threshold) const {
+        return get_sah_cost() > build_sah_cost * rebuild_threshold;
+    }
+
+    template<typename VB>
+    inline void bvh<VB>::save(std::ostream &stream) const {
+        stream.write(reinterpret_cast<const char *>(&build_sah_cost), sizeof(build_sah_cost));
+        write_cache_vector(stream, nodes);
+        write_cache_vector(stream, primitive_indices);
+    }
+
+    template<typename VB>
+    inline bool bvh<VB>::load(const char *&data, const char *end) {
+        if (static_cast<size_t>(end - data) < sizeof(build_sah_cost)) {
+            return false;
+        }
+        std::memcpy(&build_sah_cost, data, sizeof(build_sah_cost));
+        data += sizeof(build_sah_cost);
+        if (!read_cache_vector(data, end, nodes) || !read_cache_vector(data, end, primitive_indices)) {
+            return false;
+        }
+        build_wide();
+        return true;
+    }
+
+    template<typename VB>
+    inline uint64_t bvh<VB>::get_build_parameters_hash() {
+        uint64_t hash = cg::utils::hash_combine(max_depth, max_leaf_size);
+        hash = cg::utils::hash_combine(hash, max_bin_count);
+        hash = cg::utils::hash_combine(hash, static_cast<uint64_t>(traversal_cost * 1000.0f));
+        hash = cg::utils::hash_combine(hash, static_cast<uint64_t>(intersection_cost * 1000.0f));
+        return cg::utils::hash_combine(hash, sizeof(bvh_node<VB>));
+    }
+
+    template<typename VB>
+    inline void tlas<VB>::set_rebuild_threshold(float in_rebuild_threshold) {
+        rebuild_threshold = in_rebuild_threshold;
+    }
+
+    // Instances are weighted with the SAH cost of their mesh, so the result covers both levels
+    template<typename VB>
+    inline float tlas<VB>::get_sah_cost() const {
+        std::vector<float> mesh_costs(meshes.size());
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            mesh_costs[i] = meshes[i].get_bvh().get_sah_cost();
+        }
+        std::vector<float> instance_costs(instances.size());
+        for (size_t i = 0; i < instances.size(); ++i) {
+            instance_costs[i] = mesh_costs[instances[i].mesh_id];
+        }
+        return tree.get_sah_cost(instance_costs);
+    }
+
+    template<typename VB>
+    inline bool tlas<VB>::save_meshes(const std::filesystem::path &cache_path, uint64_t content_key) const {
+        // Written next to the target and renamed, so a concurrent reader never sees a partial file
+        std::filesystem::path temporary_path = cache_path;
+        temporary_path += ".tmp";
+        {
+            std::ofstream stream(temporary_path, std::ios::binary | std::ios::trunc);
+            if (!stream) {
+                return false;
+            }
+            uint64_t key = get_cache_key(content_key);
+            uint64_t mesh_count = meshes.size();
+            stream.write(reinterpret_cast<const char *>(&key), sizeof(key));
+            stream.write(reinterpret_cast<const char *>(&mesh_count), sizeof(mesh_count));
+            for (const auto &mesh: meshes) {
+                mesh.save(stream);
+            }
+            if (!stream) {
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary_path, cache_path, error);
+        if (error) {
+            std::filesystem::remove(temporary_path, error);
+            return false;
+        }
+        return true;
+    }
+
+    template<typename VB>
+    inline bool tlas<VB>::load_meshes(const std::filesystem::path &cache_path, uint64_t content_key) {
+        cg::utils::mapped_file cache_file(cache_path);
+        const char *data = cache_file.get_data();
+        const char *end = data + cache_file.get_size();
+        uint64_t header[2];
+        if (!cache_file.is_open() || cache_file.get_size() < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(header, data, sizeof(header));
+        data += sizeof(header);
+        if (header[0] != get_cache_key(content_key) || header[1] > cache_file.get_size()) {
+            return false;
+        }
+        std::vector<blas<VB>> cached_meshes(header[1]);
+        for (auto &mesh: cached_meshes) {
+            mesh.set_bvh_width(bvh_width);
+            if (!mesh.load(data, end)) {
+                return false;
+            }
+        }
+        meshes = std::move(cached_meshes);
+        return true;
+    }
+
+    template<typename VB>
+    inline uint64_t tlas<VB>::get_cache_key(uint64_t content_key) {
+        constexpr uint64_t cache_version = 3;
+        uint64_t key = cg::utils::hash_combine(content_key, cache_version);
+        key = cg::utils::hash_combine(key, bvh<VB>::get_build_parameters_hash());
+        // blas lays out its leaves in packets of this width
+        key = cg::utils::hash_combine(key, triangle_packet::width);
+        key = cg::utils::hash_combine(key, sizeof(triangle_packet));
+        key = cg::utils::hash_combine(key, sizeof(triangle_shading));
+        return cg::utils::hash_combine(key, sizeof(triangle<VB>));
+    }
+
+    template<typename VB>
+    inline std::vector<aabb<VB>> tlas<VB>::get_instance_bounds() const {
+        std::vector<aabb<VB>> bounds(instances.size());
+        for (size_t i = 0; i < instances.size(); ++i) {
+            bounds[i] = meshes[instances[i].mesh_id].get_bounds().transform(instances[i].world_matrix);
+        }
+        return bounds;
+    }
+
+    template<typename VB>
+    inline const bvh<VB> &tlas<VB>::get_bvh() const {
+        return tree;
+    }
+
+    template<typename VB>
+    inline const std::vector<blas<VB>> &tlas<VB>::get_meshes() const {
+        return meshes;
+    }
+
+    template<typename VB>
+    inline const std::vector<instance<VB>> &tlas<VB>::get_instances() const {
+        return instances;
     }
 
 }// namespace cg::renderer
\ No newline at end of file
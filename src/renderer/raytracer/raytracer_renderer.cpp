@@ -1,8 +1,10 @@
 #include "raytracer_renderer.h"
 
+#include "renderer/raytracer/bsdf.h"
 #include "utils/resource_utils.h"
 
 #include <iostream>
+#include <limits>
 
 
 void cg::renderer::ray_tracing_renderer::init() {
@@ -10,8 +12,55 @@ void cg::renderer::ray_tracing_renderer::init() {
     raytracer->set_viewport(settings->width, settings->height);
     render_target = std::make_shared<resource<unsigned_color>>(settings->width, settings->height);
     raytracer->set_render_target(render_target);
+    raytracer->set_bvh_width(settings->bvh_width);
+    raytracer->set_packet_size(settings->ray_packet_size);
+    raytracer->set_tile_size(settings->tile_size);
+    if (settings->sampler == "sobol") {
+        raytracer->set_sampler_type(sampler_type::sobol);
+    }
+    else if (settings->sampler == "random") {
+        raytracer->set_sampler_type(sampler_type::random);
+    }
+    else {
+        THROW_ERROR("Unknown sampler " + settings->sampler);
+    }
+    raytracer->set_target_error(settings->target_error);
+    raytracer->set_wavefront(settings->wavefront);
+    raytracer->set_russian_roulette_depth(settings->russian_roulette_depth);
+    tonemap_operator output_tonemap_operator;
+    if (settings->tonemap == "clamp") {
+        output_tonemap_operator = tonemap_operator::clamp;
+    }
+    else if (settings->tonemap == "reinhard") {
+        output_tonemap_operator = tonemap_operator::reinhard;
+    }
+    else if (settings->tonemap == "aces") {
+        output_tonemap_operator = tonemap_operator::aces;
+    }
+    else {
+        THROW_ERROR("Unknown tonemap operator " + settings->tonemap);
+    }
+    raytracer->set_tonemap(output_tonemap_operator, settings->exposure);
+    raytracer->set_checkpoint(settings->checkpoint_path, settings->checkpoint_interval);
+    raytracer->set_first_sample(settings->first_sample);
+    raytracer->set_time_budget(static_cast<double>(settings->time_budget_ms) / 1000.0);
+    raytracer->set_denoise(settings->denoise);
     model = std::make_shared<cg::world::model>();
-    model->load_obj(settings->model_path);
+    if (settings->bvh_cache) {
+        acceleration_structure_cache_path = settings->model_path;
+        acceleration_structure_cache_path += ".bvh";
+        model_content_hash = cg::world::model::get_content_hash(settings->model_path);
+        acceleration_structure_cached = raytracer->get_acceleration_structure()->load_meshes(
+                acceleration_structure_cache_path, model_content_hash);
+    }
+    // Cached meshes already hold the triangles, the OBJ is only parsed on a cache miss. Refits assemble the
+    // triangles from the vertex buffers again, so renders of several frames always load it
+    if (acceleration_structure_cached) {
+        std::cout << "Acceleration structure loaded from " << acceleration_structure_cache_path << std::endl;
+    }
+    if (!acceleration_structure_cached || settings->frames > 1) {
+        model->load_obj(settings->model_path);
+    }
     camera = std::make_shared<cg::world::camera>();
     camera->set_height(static_cast<float>(settings->height));
     camera->set_width(static_cast<float>(settings->width));
@@ -25,71 +74,196 @@ void cg::renderer::ray_tracing_renderer::init() {
 
     raytracer->set_vertex_buffers(model->get_vertex_buffers());
     raytracer->set_index_buffers(model->get_index_buffers());
-
-    lights.push_back({float3{-0.24f, 1.97f, 0.16f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
-    lights.push_back({float3{-0.24f, 1.97f, -0.22f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
-    lights.push_back({float3{0.23f, 1.97f, -0.22f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
-    lights.push_back({float3{0.23f, 1.97f, 0.16f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
-
-    shadow_raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
-    shadow_raytracer->set_vertex_buffers(model->get_vertex_buffers());
-    shadow_raytracer->set_index_buffers(model->get_index_buffers());
+    size_t shape_count = acceleration_structure_cached ? raytracer->get_acceleration_structure()->get_meshes().size()
+                                                       : model->get_index_buffers().size();
+    for (unsigned int shape = 0; shape < shape_count; ++shape) {
+        raytracer->add_instance(shape, model->get_world_matrix());
+    }
 }
 
 void cg::renderer::ray_tracing_renderer::destroy() {}
 
-void cg::renderer::ray_tracing_renderer::update() {}
+void cg::renderer::ray_tracing_renderer::update() {
+    // The first frame builds the acceleration structure, there is nothing to refit before it
+    if (!acceleration_structure_built) {
+        return;
+    }
+    auto refit_start = std::chrono::high_resolution_clock::now();
+    raytracer->refit();
+    auto refit_end = std::chrono::high_resolution_clock::now();
+    std::cout << "Acceleration structure refit time: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(refit_end - refit_start).count()
+              << "ms, SAH cost: " << raytracer->get_acceleration_structure()->get_sah_cost() << std::endl;
+}
 
 void cg::renderer::ray_tracing_renderer::render() {
     raytracer->clear_render_target({0, 0, 0});
-    raytracer->build_acceleration_structure();
+    std::vector<std::filesystem::path> checkpoints;
+    if (settings->resume) {
+        if (settings->checkpoint_path.empty()) {
+            THROW_ERROR("Resuming needs a checkpoint_path");
+        }
+        // A render killed before its first checkpoint starts over
+        if (std::filesystem::exists(settings->checkpoint_path)) {
+            checkpoints.push_back(settings->checkpoint_path);
+        }
+    }
+    for (const auto &merged_checkpoint: settings->merge_checkpoints) {
+        if (!merged_checkpoint.empty()) {
+            checkpoints.emplace_back(merged_checkpoint);
+        }
+    }
+    for (const auto &checkpoint: checkpoints) {
+        // Starting over would overwrite the samples of a checkpoint that exists but can't be read
+        if (!raytracer->load_checkpoint(checkpoint)) {
+            THROW_ERROR("Can't resume from the checkpoint " + checkpoint.string());
+        }
+        std::cout << "Resumed from the checkpoint " << checkpoint << std::endl;
+    }
+    if (!acceleration_structure_built) {
+        auto build_start = std::chrono::high_resolution_clock::now();
+        raytracer->build_acceleration_structure();
+        auto build_end = std::chrono::high_resolution_clock::now();
+        std::cout << "Acceleration structure build time: "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(build_end - build_start).count()
+                  << "ms, SAH cost: " << raytracer->get_acceleration_structure()->get_sah_cost() << std::endl;
+        if (settings->bvh_cache && !acceleration_structure_cached) {
+            acceleration_structure_cached = raytracer->get_acceleration_structure()->save_meshes(
+                    acceleration_structure_cache_path, model_content_hash);
+            if (!acceleration_structure_cached) {
+                std::cout << "Can't write the acceleration structure cache " << acceleration_structure_cache_path
+                          << std::endl;
+            }
+        }
+        acceleration_structure_built = true;
+    }
+    std::cout << "Emissive triangles: " << raytracer->get_emissive_triangles().size() << std::endl;
+    // The point lights stand in for the Cornell box ceiling light in scenes without emissive triangles. With
+    // them, next event estimation already samples the ceiling light and they would count it twice
+    lights.clear();
+    if (raytracer->get_emissive_triangles().empty()) {
+        lights.push_back({float3{-0.24f, 1.97f, 0.16f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
+        lights.push_back({float3{-0.24f, 1.97f, -0.22f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
+        lights.push_back({float3{0.23f, 1.97f, -0.22f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
+        lights.push_back({float3{0.23f, 1.97f, 0.16f}, float3{0.78f, 0.78f, 0.78f} / 4.0f});
+    }
     raytracer->miss_shader = [](auto &r) {
         payload p{};
         p.color = {0.0f, 0.0f, 0.0f};
         return p;
     };
-    shadow_raytracer->acceleration_structures = raytracer->acceleration_structures;
-    shadow_raytracer->miss_shader = [](auto &r) {
-        payload p{};
-        p.t = -1.0f;
-        return p;
+    // Solid angle pdf of next event estimation picking this point of an emissive triangle, seen at distance
+    // along direction. Triangles emit on the side of their normal only
+    auto emissive_pdf = [this](auto &triangle, const float3 &direction, float distance) {
+        float3 triangle_normal = normalize(cross(triangle.ba, triangle.ca));
+        float cosine = -dot(triangle_normal, direction);
+        if (dot(triangle_normal, triangle.na) < 0.0f) {
+            cosine = -cosine;
+        }
+        if (cosine <= 0.0f) {
+            return 0.0f;
+        }
+        return raytracer->get_light_pdf(triangle) * distance * distance / cosine;
+    };
+    // Power heuristic
+    auto mis_weight = [](float pdf, float other_pdf) {
+        return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+    };
+    // Emission seen by a ray, weighted against next event estimation at the hit the ray came from. Camera rays
+    // and other rays without a pdf see all of it
+    auto emitted_light = [emissive_pdf, mis_weight](auto &ray, auto &payload, auto &triangle) {
+        if (maxelem(triangle.emissive) == 0.0f || dot(triangle.na, ray.direction) >= 0.0f) {
+            return float3{0.0f};
+        }
+        if (payload.ray_pdf == 0.0f) {
+            return triangle.emissive;
+        }
+        float light_pdf = emissive_pdf(triangle, ray.direction, payload.t);
+        return triangle.emissive * mis_weight(payload.ray_pdf, light_pdf);
     };
-    shadow_raytracer->any_hit_shader = [](auto &ray, auto &payload, auto &triangle) {
-        return payload;
+    // Light of the point lights and of one sampled point on an emissive triangle. Without a bounce after the
+    // hit, the sampled light is not weighted against the bounce hitting the emitter
+    auto direct_light = [this, emissive_pdf, mis_weight](const float3 &position, const float3 &normal,
+                                                         const float3 &wo, const auto &bsdf, bool bounces) {
+        float3 result_color{0.0f};
+        for (auto &light: lights) {
+            cg::renderer::ray to_light(position, light.position - position);
+            if (!raytracer->occluded(to_light, length(light.position - position))) {
+                // Point lights keep their old falloff free response, the albedo times the cosine
+                result_color += bsdf.evaluate(normal, wo, to_light.direction) * pi * light.color *
+                                std::max(dot(normal, to_light.direction), 0.0f);
+            }
+        }
+        auto &sampler = raytracer->get_sampler();
+        float u_light = sampler.get_1d();
+        auto light = raytracer->sample_light(u_light, sampler.get_2d());
+        if (!light.emitter) {
+            return result_color;
+        }
+        const auto &light_triangle = *light.emitter;
+        const float3 &light_point = light.position;
+        float distance = length(light_point - position);
+        cg::renderer::ray to_light(position, light_point - position);
+        float cosine = dot(normal, to_light.direction);
+        float light_pdf = emissive_pdf(light_triangle, to_light.direction, distance);
+        if (cosine <= 0.0f || light_pdf == 0.0f || raytracer->occluded(to_light, distance * 0.999f)) {
+            return result_color;
+        }
+        float weight = bounces ? mis_weight(light_pdf, bsdf.pdf(normal, wo, to_light.direction)) : 1.0f;
+        result_color += bsdf.evaluate(normal, wo, to_light.direction) * light_triangle.emissive * cosine * weight /
+                        light_pdf;
+        return result_color;
     };
-    std::random_device rd;
-    std::mt19937 rng(rd());
-    std::uniform_real_distribution<float> uniformRealDistribution(-1.0f, 1.0f);
-    auto rt_depth = settings->raytracing_depth;
-    raytracer->closest_hit_shader = [this, &uniformRealDistribution, &rng, rt_depth](auto &ray, auto &payload,
-                                                                                     auto &triangle,
-                                                                                     size_t depth) {
+    // Paths are traced in a loop from the bounce shader, the stack does not grow with the depth
+    raytracer->bounce_shader = [this, emitted_light, direct_light](auto &ray, auto &payload, auto &triangle,
+                                                                   size_t depth) {
         float3 position = ray.position + ray.direction * payload.t;
         float3 normal = normalize(
                 payload.bary.x * triangle.na +
                 payload.bary.y * triangle.nb +
                 payload.bary.z * triangle.nc
         );
-        float3 result_color = triangle.emissive;
-
-        float3 random_direction{uniformRealDistribution(rng), uniformRealDistribution(rng),
-                                uniformRealDistribution(rng)};
-        if (dot(normal, random_direction) < 0.0f) {
-            random_direction = -random_direction;
+        float3 wo = -ray.direction;
+        lambertian_bsdf bsdf(triangle.diffuse);
+        cg::renderer::bounce result;
+        result.color = emitted_light(ray, payload, triangle) + direct_light(position, normal, wo, bsdf, depth > 0);
+        // The miss shader is black, a path out of depth gets nothing from one more bounce
+        if (depth > 0) {
+            bsdf_sample sample = bsdf.sample(normal, wo, raytracer->get_sampler().get_2d());
+            result.next_ray = cg::renderer::ray(position, sample.direction);
+            result.next_weight = sample.weight;
+            result.next_pdf = sample.pdf;
         }
-        cg::renderer::ray to_next_object(position, random_direction);
-        auto payload_next = raytracer->trace_ray(to_next_object, depth);
-        result_color += triangle.diffuse * payload_next.color.to_float3() *
-                        std::max(dot(normal, to_next_object.direction), 0.0f);
-
-        payload.color = cg::color::from_float3(result_color);
-        return payload;
+        return result;
     };
+    raytracer->reset_ray_statistics();
     auto start = std::chrono::high_resolution_clock::now();
+    size_t max_samples = settings->target_error > 0.0f ? settings->max_spp : settings->accumulation_num;
+    // Frames are traced until the time is up, unless adaptive sampling stops them first
+    if (settings->time_budget_ms > 0 && settings->target_error <= 0.0f) {
+        max_samples = std::numeric_limits<int>::max();
+    }
     raytracer->ray_generation(camera->get_position(), camera->get_direction(), camera->get_right(), camera->get_up(),
-                              settings->raytracing_depth, settings->accumulation_num);
+                              settings->raytracing_depth, max_samples);
     auto end = std::chrono::high_resolution_clock::now();
-    std::cout << "Render time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
-              << "ms" << std::endl;
+    auto render_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    std::cout << "Render time: " << render_time << "ms" << std::endl;
+    auto ray_statistics = raytracer->get_ray_statistics();
+    std::cout << "Traced rays: " << ray_statistics.rays << ", visited BVH nodes per ray: "
+              << static_cast<float>(ray_statistics.visited_nodes) / static_cast<float>(std::max<size_t>(ray_statistics.rays, 1))
+              << ", Mrays/s: " << static_cast<float>(ray_statistics.rays) / 1000.0f / static_cast<float>(std::max<long long>(render_time, 1))
+              << std::endl;
+    std::cout << "Samples per pixel: "
+              << static_cast<float>(raytracer->get_sample_count()) / static_cast<float>(settings->width * settings->height)
+              << std::endl;
+    const auto &thread_statistics = raytracer->get_thread_statistics();
+    std::cout << "Thread busy time:";
+    for (const auto &statistics: thread_statistics) {
+        std::cout << " " << static_cast<long long>(statistics.busy_time * 1000.0) << "ms";
+    }
+    std::cout << std::endl;
     cg::utils::save_resource(*render_target, settings->result_path);
+    if (!settings->hdr_result_path.empty()) {
+        cg::utils::save_hdr_resource(*raytracer->get_radiance(), settings->hdr_result_path);
+    }
 }
\ No newline at end of file
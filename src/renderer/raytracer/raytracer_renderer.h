@@ -18,8 +18,12 @@ namespace cg::renderer
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 
 		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> raytracer;
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
 
 		std::vector<cg::renderer::light> lights;
+
+		std::filesystem::path acceleration_structure_cache_path;
+		uint64_t model_content_hash = 0;
+		bool acceleration_structure_cached = false;
+		bool acceleration_structure_built = false;
 	};
 }// namespace cg::renderer
\ No newline at end of file
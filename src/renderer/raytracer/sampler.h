@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <linalg.h>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer {
+    // PCG32 (O'Neill), XSH RR output of a 64 bit LCG
+    struct pcg32 {
+        void seed(uint64_t initial_state, uint64_t sequence);
+
+        uint32_t next();
+
+        uint64_t state = 0x853c49e6748fea9bull;
+        uint64_t increment = 0xda3e39cb94b95bdbull;
+    };
+
+    enum class sampler_type {
+        // Independent uniform numbers from a PCG stream per pixel sample
+        random,
+        // Sobol points with hash based Owen scrambling (Burley 2020), decorrelated per pixel and dimension pair
+        sobol
+    };
+
+    // Numbers of one sample of one pixel. Dimensions are drawn in order, so a path asks for the same
+    // dimension at the same bounce whatever order the pixels are rendered in
+    class sampler {
+    public:
+        void start(uint32_t in_pixel, uint32_t in_sample_index, sampler_type in_type);
+
+        float get_1d();
+
+        float2 get_2d();
+
+        uint32_t get_dimension() const;
+
+    protected:
+        float to_float(uint32_t bits) const;
+
+        pcg32 generator;
+        uint32_t pixel = 0;
+        uint32_t sample_index = 0;
+        uint32_t dimension = 0;
+        sampler_type type = sampler_type::sobol;
+    };
+
+    inline uint32_t hash(uint32_t x) {
+        // lowbias32 by Chris Wellons
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    inline uint32_t hash_combine(uint32_t seed, uint32_t value) {
+        return hash(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+    }
+
+    inline uint32_t reverse_bits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+        return x;
+    }
+
+    // Random permutation of x where every bit only depends on the bits below it (Laine and Karras 2011)
+    inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    // Owen scrambling of a 32 bit fraction: every bit is flipped depending on the bits above it
+    inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+        return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+    }
+
+    // First two dimensions of the Sobol sequence as 32 bit fractions
+    inline uint2 sobol_2d(uint32_t index) {
+        // The first dimension is the van der Corput sequence, the direction numbers of the second one come from
+        // the primitive polynomial x + 1
+        uint2 result{reverse_bits(index), 0u};
+        uint32_t direction = 1u << 31;
+        for (uint32_t i = index; i != 0; i >>= 1, direction ^= direction >> 1) {
+            if (i & 1u) {
+                result.y ^= direction;
+            }
+        }
+        return result;
+    }
+
+    inline void pcg32::seed(uint64_t initial_state, uint64_t sequence) {
+        state = 0;
+        increment = (sequence << 1u) | 1u;
+        next();
+        state += initial_state;
+        next();
+    }
+
+    inline uint32_t pcg32::next() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ull + increment;
+        auto xor_shifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+        auto rotation = static_cast<uint32_t>(old_state >> 59u);
+        return (xor_shifted >> rotation) | (xor_shifted << ((~rotation + 1u) & 31u));
+    }
+
+    inline void sampler::start(uint32_t in_pixel, uint32_t in_sample_index, sampler_type in_type) {
+        pixel = in_pixel;
+        sample_index = in_sample_index;
+        dimension = 0;
+        type = in_type;
+        if (type == sampler_type::random) {
+            generator.seed(hash_combine(pixel, sample_index), pixel);
+        }
+    }
+
+    inline float sampler::get_1d() {
+        return get_2d().x;
+    }
+
+    inline float2 sampler::get_2d() {
+        uint32_t pair = dimension / 2;
+        // A 1D draw spends a whole pair, so 2D draws always start on an even dimension
+        dimension = (pair + 1) * 2;
+        if (type == sampler_type::random) {
+            uint32_t x = generator.next();
+            return float2{to_float(x), to_float(generator.next())};
+        }
+        uint32_t seed = hash_combine(hash(pixel), pair);
+        // Shuffling the sample index differently per pair decorrelates the pairs
+        uint2 point = sobol_2d(nested_uniform_scramble(sample_index, seed));
+        return float2{to_float(nested_uniform_scramble(point.x, hash_combine(seed, 1u))),
+                      to_float(nested_uniform_scramble(point.y, hash_combine(seed, 2u)))};
+    }
+
+    inline uint32_t sampler::get_dimension() const {
+        return dimension;
+    }
+
+    inline float sampler::to_float(uint32_t bits) const {
+        // 24 bits fit the float mantissa, the result stays below 1
+        return static_cast<float>(bits >> 8) * (1.0f / 16777216.0f);
+    }
+}// namespace cg::renderer
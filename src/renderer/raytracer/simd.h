@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CG_SIMD_X86
+#endif
+
+#ifdef CG_SIMD_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC accepts AVX2 intrinsics in any function, the code is only executed after a runtime check
+#define CG_TARGET_AVX2
+#define CG_TARGET_AVX
+#else
+#include <immintrin.h>
+#define CG_TARGET_AVX2 __attribute__((target("avx2,fma")))
+// No FMA: multiplies and adds are never fused, so the results match the scalar code bit for bit
+#define CG_TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
+
+namespace cg::renderer::simd {
+    inline bool detect_avx2() {
+#ifdef CG_SIMD_X86
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
+        __cpuid(info, 1);
+        bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+        bool has_fma = info[2] & (1 << 12);
+        __cpuidex(info, 7, 0);
+        return os_saves_ymm && has_fma && (info[1] & (1 << 5));
+#else
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+#else
+        return false;
+#endif
+    }
+
+    inline bool has_avx2() {
+        static const bool result = detect_avx2();
+        return result;
+    }
+
+    enum class isa {
+        scalar,
+        sse,
+        avx2
+    };
+
+    inline isa &max_isa() {
+        static isa value = isa::avx2;
+        return value;
+    }
+
+    // Lowers the instruction set picked at runtime, e.g. to compare the SIMD kernels against the scalar code
+    inline void set_max_isa(isa in_max_isa) {
+        max_isa() = in_max_isa;
+    }
+
+    inline isa get_isa() {
+#ifdef CG_SIMD_X86
+        isa supported = has_avx2() ? isa::avx2 : isa::sse;
+#else
+        isa supported = isa::scalar;
+#endif
+        return std::min(supported, max_isa());
+    }
+
+    // Hint only, a no-op where the instruction is not available
+    inline void prefetch(const void *address) {
+#ifdef CG_SIMD_X86
+        _mm_prefetch(static_cast<const char *>(address), _MM_HINT_T0);
+#else
+        (void) address;
+#endif
+    }
+}// namespace cg::renderer::simd
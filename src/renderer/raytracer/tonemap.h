@@ -0,0 +1,145 @@
+#pragma once
+
+#include "renderer/raytracer/simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cg::renderer {
+    enum class tonemap_operator {
+        // Linear, values above 1 are clipped
+        clamp,
+        // x / (1 + x)
+        reinhard,
+        // Fitted ACES filmic curve (Narkowicz 2015)
+        aces
+    };
+
+    // Maps linear HDR channel values to 8 bit sRGB: the values are scaled by 2^exposure, go through the
+    // operator and are encoded with the sRGB transfer function. Channels are independent, so linear and
+    // encoded are flat arrays of count floats and bytes in any channel layout
+    void tonemap(const float *linear, uint8_t *encoded, size_t count, float exposure, tonemap_operator op);
+
+    // Table of the sRGB encoded bytes of [0, 1], fine enough that the dark end, where the curve is steepest,
+    // steps by less than one output level
+    constexpr unsigned int srgb_table_size = 1 << 14;
+
+    inline const std::vector<uint8_t> &get_srgb_table() {
+        static const std::vector<uint8_t> table = [] {
+            std::vector<uint8_t> result(srgb_table_size);
+            for (unsigned int i = 0; i < srgb_table_size; ++i) {
+                float value = static_cast<float>(i) / static_cast<float>(srgb_table_size - 1);
+                float encoded = value <= 0.0031308f ? 12.92f * value : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+                result[i] = static_cast<uint8_t>(std::clamp(encoded, 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+            return result;
+        }();
+        return table;
+    }
+
+    inline float apply_tonemap_operator(float x, tonemap_operator op) {
+        switch (op) {
+            case tonemap_operator::reinhard:
+                return x / (1.0f + x);
+            case tonemap_operator::aces:
+                return x * (2.51f * x + 0.03f) / (x * (2.43f * x + 0.59f) + 0.14f);
+            default:
+                return x;
+        }
+    }
+
+    // Inputs are capped so the operators can't overflow to NaN, the largest half float is far into white
+    constexpr float max_tonemap_input = 65504.0f;
+
+    // Position of a tonemapped value in the sRGB table. NaN and negative values map to 0
+    inline int32_t get_srgb_index(float linear, float scale, tonemap_operator op) {
+        // Zero first: std::max returns it for NaN, as the SIMD max does with zero second
+        float mapped = apply_tonemap_operator(std::min(std::max(0.0f, linear * scale), max_tonemap_input), op);
+        mapped = std::min(std::max(0.0f, mapped), 1.0f);
+        return static_cast<int32_t>(mapped * static_cast<float>(srgb_table_size - 1) + 0.5f);
+    }
+
+    // The kernels compute the same table indices as get_srgb_index, the operators are evaluated with the same
+    // operations in the same order and without fused multiply adds
+#ifdef CG_SIMD_X86
+    inline void get_srgb_indices_4_sse(const float *linear, float scale, tonemap_operator op, int32_t *indices) {
+        __m128 zero = _mm_setzero_ps();
+        __m128 one = _mm_set1_ps(1.0f);
+        __m128 x = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(linear), _mm_set1_ps(scale)), zero);
+        x = _mm_min_ps(x, _mm_set1_ps(max_tonemap_input));
+        if (op == tonemap_operator::reinhard) {
+            x = _mm_div_ps(x, _mm_add_ps(one, x));
+        } else if (op == tonemap_operator::aces) {
+            __m128 numerator = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), x), _mm_set1_ps(0.03f)));
+            __m128 denominator = _mm_add_ps(
+                    _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), x), _mm_set1_ps(0.59f))),
+                    _mm_set1_ps(0.14f));
+            x = _mm_div_ps(numerator, denominator);
+        }
+        x = _mm_min_ps(_mm_max_ps(x, zero), one);
+        x = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(static_cast<float>(srgb_table_size - 1))), _mm_set1_ps(0.5f));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(indices), _mm_cvttps_epi32(x));
+    }
+
+    CG_TARGET_AVX inline void get_srgb_indices_8_avx(const float *linear, float scale, tonemap_operator op,
+                                                     int32_t *indices) {
+        __m256 zero = _mm256_setzero_ps();
+        __m256 one = _mm256_set1_ps(1.0f);
+        __m256 x = _mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(linear), _mm256_set1_ps(scale)), zero);
+        x = _mm256_min_ps(x, _mm256_set1_ps(max_tonemap_input));
+        if (op == tonemap_operator::reinhard) {
+            x = _mm256_div_ps(x, _mm256_add_ps(one, x));
+        } else if (op == tonemap_operator::aces) {
+            __m256 numerator = _mm256_mul_ps(
+                    x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), x), _mm256_set1_ps(0.03f)));
+            __m256 denominator = _mm256_add_ps(
+                    _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), x), _mm256_set1_ps(0.59f))),
+                    _mm256_set1_ps(0.14f));
+            x = _mm256_div_ps(numerator, denominator);
+        }
+        x = _mm256_min_ps(_mm256_max_ps(x, zero), one);
+        x = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(static_cast<float>(srgb_table_size - 1))),
+                          _mm256_set1_ps(0.5f));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(indices), _mm256_cvttps_epi32(x));
+    }
+#endif
+
+    inline void tonemap(const float *linear, uint8_t *encoded, size_t count, float exposure, tonemap_operator op) {
+        const uint8_t *table = get_srgb_table().data();
+        float scale = std::exp2(exposure);
+        constexpr size_t block_size = 1024;
+        auto block_count = static_cast<int>((count + block_size - 1) / block_size);
+#pragma omp parallel for
+        for (int block = 0; block < block_count; ++block) {
+            size_t first = static_cast<size_t>(block) * block_size;
+            size_t last = std::min(first + block_size, count);
+            size_t i = first;
+            int32_t indices[8];
+#ifdef CG_SIMD_X86
+            simd::isa isa = simd::get_isa();
+            if (isa == simd::isa::avx2) {
+                for (; i + 8 <= last; i += 8) {
+                    get_srgb_indices_8_avx(linear + i, scale, op, indices);
+                    for (int lane = 0; lane < 8; ++lane) {
+                        encoded[i + lane] = table[indices[lane]];
+                    }
+                }
+            }
+            if (isa != simd::isa::scalar) {
+                for (; i + 4 <= last; i += 4) {
+                    get_srgb_indices_4_sse(linear + i, scale, op, indices);
+                    for (int lane = 0; lane < 4; ++lane) {
+                        encoded[i + lane] = table[indices[lane]];
+                    }
+                }
+            }
+#endif
+            for (; i < last; ++i) {
+                encoded[i] = table[get_srgb_index(linear[i], scale, op)];
+            }
+        }
+    }
+}// namespace cg::renderer
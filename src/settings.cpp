@@ -25,6 +25,26 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("bvh_width", "Children per BVH node used for traversal: 2, 4 (SSE) or 8 (AVX2)", cxxopts::value<unsigned>()->default_value("8"));
+	add_options("bvh_cache", "Load and store the acceleration structure in a cache file next to the model", cxxopts::value<bool>()->default_value("true"));
+	add_options("ray_packet_size", "Camera rays are traced in packets of NxN pixels, from 1 (single rays) to 8", cxxopts::value<unsigned>()->default_value("4"));
+	add_options("tile_size", "The image is rendered in tiles of NxN pixels, taken by the threads one at a time", cxxopts::value<unsigned>()->default_value("16"));
+	add_options("sampler", "Random numbers of the pixel samples: sobol (Owen scrambled) or random", cxxopts::value<std::string>()->default_value("sobol"));
+	add_options("target_error", "Adaptive sampling: tiles stop taking samples once the relative error of their pixels is below this, 0 disables", cxxopts::value<float>()->default_value("0"));
+	add_options("max_spp", "Samples per pixel at most with adaptive sampling, replaces accumulation_num", cxxopts::value<unsigned>()->default_value("256"));
+	add_options("russian_roulette_depth", "Bounces after which paths are randomly stopped depending on their weight", cxxopts::value<unsigned>()->default_value("3"));
+	add_options("wavefront", "Trace the paths one bounce at a time over batches of pixels, with sorted secondary rays", cxxopts::value<bool>()->default_value("false"));
+	add_options("tonemap", "Operator mapping the HDR result to the 8 bit image: clamp, reinhard or aces", cxxopts::value<std::string>()->default_value("clamp"));
+	add_options("exposure", "Exposure of the 8 bit image in stops", cxxopts::value<float>()->default_value("0"));
+	add_options("hdr_result_path", "Path to the linear float result, .pfm or .exr, empty to skip it", cxxopts::value<std::filesystem::path>()->default_value(""));
+	add_options("checkpoint_path", "Path the accumulated samples are saved to while rendering, empty to skip it", cxxopts::value<std::filesystem::path>()->default_value(""));
+	add_options("checkpoint_interval", "Seconds between two checkpoints", cxxopts::value<float>()->default_value("60"));
+	add_options("resume", "Continue accumulating from the checkpoint at checkpoint_path, up to accumulation_num frames", cxxopts::value<bool>()->default_value("false"));
+	add_options("first_sample", "Sample index of the first frame, renders of disjoint sample ranges can be merged", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("merge_checkpoints", "Checkpoints of other renders of the same view, added to the accumulated samples", cxxopts::value<std::vector<std::string>>()->default_value(""));
+	add_options("time_budget_ms", "Frames are traced until this many milliseconds are used up, replaces accumulation_num, 0 disables", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("denoise", "Filter the result with an edge avoiding a-trous wavelet guided by the first hit normal, albedo and depth", cxxopts::value<bool>()->default_value("false"));
+	add_options("frames", "Number of frames rendered, the acceleration structure is refit to the vertex buffers before every frame but the first", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("h,help", "Print usage");
 
 	auto result = options.parse(argc, argv);
@@ -46,6 +66,26 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->bvh_width = result["bvh_width"].as<unsigned>();
+	settings->bvh_cache = result["bvh_cache"].as<bool>();
+	settings->ray_packet_size = result["ray_packet_size"].as<unsigned>();
+	settings->tile_size = result["tile_size"].as<unsigned>();
+	settings->sampler = result["sampler"].as<std::string>();
+	settings->target_error = result["target_error"].as<float>();
+	settings->max_spp = result["max_spp"].as<unsigned>();
+	settings->russian_roulette_depth = result["russian_roulette_depth"].as<unsigned>();
+	settings->wavefront = result["wavefront"].as<bool>();
+	settings->tonemap = result["tonemap"].as<std::string>();
+	settings->exposure = result["exposure"].as<float>();
+	settings->hdr_result_path = result["hdr_result_path"].as<std::filesystem::path>();
+	settings->checkpoint_path = result["checkpoint_path"].as<std::filesystem::path>();
+	settings->checkpoint_interval = result["checkpoint_interval"].as<float>();
+	settings->resume = result["resume"].as<bool>();
+	settings->first_sample = result["first_sample"].as<unsigned>();
+	settings->merge_checkpoints = result["merge_checkpoints"].as<std::vector<std::string>>();
+	settings->time_budget_ms = result["time_budget_ms"].as<unsigned>();
+	settings->denoise = result["denoise"].as<bool>();
+	settings->frames = result["frames"].as<unsigned>();
 
 	return settings;
 }
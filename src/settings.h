@@ -27,6 +27,26 @@ namespace cg
 
 		unsigned raytracing_depth;
 		unsigned accumulation_num;
+		unsigned bvh_width;
+		bool bvh_cache;
+		unsigned ray_packet_size;
+		unsigned tile_size;
+		std::string sampler;
+		float target_error;
+		unsigned max_spp;
+		unsigned russian_roulette_depth;
+		bool wavefront;
+		std::string tonemap;
+		float exposure;
+		std::filesystem::path hdr_result_path;
+		std::filesystem::path checkpoint_path;
+		float checkpoint_interval;
+		bool resume;
+		unsigned first_sample;
+		std::vector<std::string> merge_checkpoints;
+		unsigned time_budget_ms;
+		bool denoise;
+		unsigned frames;
 	};
 
 }// namespace cg
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "renderer/raytracer/raytracer.h"
+
+#include <cmath>
+#include <iostream>
+
+// Builds a mesh of far apart clusters of three triangles, so the leaves are padded to whole packets, with the
+// emitters in the last cluster. Checks that the light list has all of them and that its pdf integrates to 1
+
+using namespace cg::renderer;
+
+namespace {
+    constexpr unsigned int cluster_size = 3;
+    constexpr unsigned int cluster_count = 21;
+    constexpr unsigned int triangle_count = cluster_size * cluster_count;
+    constexpr unsigned int emissive_count = cluster_size;
+
+    cg::vertex make_vertex(float x, float y, float z, float emission) {
+        cg::vertex v{};
+        v.x = x;
+        v.y = y;
+        v.z = z;
+        v.ny = -1.0f;
+        v.diffuse_r = v.diffuse_g = v.diffuse_b = 0.5f;
+        v.emissive_r = v.emissive_g = v.emissive_b = emission;
+        return v;
+    }
+
+    bool check(bool condition, const char *message) {
+        if (!condition) {
+            std::cerr << "FAILED: " << message << std::endl;
+        }
+        return condition;
+    }
+}// namespace
+
+int main() {
+    try {
+        // Clusters 100 units apart along x, the triangles of a cluster 1 unit apart along z
+        auto vertex_buffer = std::make_shared<cg::resource<cg::vertex>>(triangle_count * 3);
+        auto index_buffer = std::make_shared<cg::resource<unsigned int>>(triangle_count * 3);
+        for (unsigned int i = 0; i < triangle_count; ++i) {
+            float x = 100.0f * static_cast<float>(i / cluster_size);
+            float z = static_cast<float>(i % cluster_size);
+            float emission = i >= triangle_count - emissive_count ? 1.0f + z : 0.0f;
+            vertex_buffer->item(i * 3) = make_vertex(x, 0.0f, z, emission);
+            vertex_buffer->item(i * 3 + 1) = make_vertex(x + 1.0f, 0.0f, z, emission);
+            vertex_buffer->item(i * 3 + 2) = make_vertex(x, 0.0f, z + 0.5f, emission);
+            for (unsigned int corner = 0; corner < 3; ++corner) {
+                index_buffer->item(i * 3 + corner) = i * 3 + corner;
+            }
+        }
+
+        raytracer<cg::vertex, cg::unsigned_color> raytracer;
+        raytracer.set_vertex_buffers({vertex_buffer});
+        raytracer.set_index_buffers({index_buffer});
+        raytracer.build_acceleration_structure();
+
+        const auto &mesh = raytracer.get_acceleration_structure()->get_meshes()[0];
+        const auto &primitive_indices = mesh.get_bvh().get_primitive_indices();
+        size_t last_emissive_slot = 0;
+        for (size_t slot = 0; slot < primitive_indices.size(); ++slot) {
+            if (primitive_indices[slot] != bvh<cg::vertex>::invalid_primitive &&
+                primitive_indices[slot] >= triangle_count - emissive_count) {
+                last_emissive_slot = slot;
+            }
+        }
+
+        bool passed = true;
+        passed &= check(last_emissive_slot >= mesh.get_triangle_count(),
+                        "no emitter lies past the triangle count, the leaves are not padded as expected");
+        const auto &emitters = raytracer.get_emissive_triangles();
+        passed &= check(emitters.size() == emissive_count, "the light list misses emissive triangles");
+        float total_probability = 0.0f;
+        for (const auto &emitter: emitters) {
+            float area = 0.5f * length(cross(emitter.ba, emitter.ca));
+            total_probability += raytracer.get_light_pdf(emitter) * area;
+        }
+        passed &= check(std::abs(total_probability - 1.0f) < 1e-4f, "the light pdf does not integrate to 1");
+
+        std::cout << "Slots: " << primitive_indices.size() << ", triangles: " << mesh.get_triangle_count()
+                  << ", last emissive slot: " << last_emissive_slot << ", emitters found: " << emitters.size()
+                  << ", total probability: " << total_probability << std::endl;
+        return passed ? 0 : 1;
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
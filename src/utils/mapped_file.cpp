@@ -0,0 +1,111 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+using namespace cg::utils;
+
+mapped_file::mapped_file(const std::filesystem::path &filepath) {
+#ifdef _WIN32
+    HANDLE file_handle = CreateFileW(filepath.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    file = file_handle;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size)) {
+        close();
+        return;
+    }
+    size = static_cast<size_t>(file_size.QuadPart);
+    if (size > 0) {
+        mapping = CreateFileMappingW(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            close();
+            return;
+        }
+        data = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!data) {
+            close();
+            return;
+        }
+    }
+#else
+    file = open(filepath.c_str(), O_RDONLY);
+    if (file < 0) {
+        return;
+    }
+    struct stat file_stat {};
+    if (fstat(file, &file_stat) != 0) {
+        close();
+        return;
+    }
+    size = static_cast<size_t>(file_stat.st_size);
+    if (size > 0) {
+        void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (address == MAP_FAILED) {
+            close();
+            return;
+        }
+        data = static_cast<const char *>(address);
+    }
+#endif
+    opened = true;
+}
+
+mapped_file::~mapped_file() {
+    close();
+}
+
+bool mapped_file::is_open() const {
+    return opened;
+}
+
+const char *mapped_file::get_data() const {
+    return data;
+}
+
+size_t mapped_file::get_size() const {
+    return size;
+}
+
+void mapped_file::close() {
+#ifdef _WIN32
+    if (data) {
+        UnmapViewOfFile(data);
+    }
+    if (mapping) {
+        CloseHandle(mapping);
+    }
+    if (file) {
+        CloseHandle(file);
+    }
+    mapping = nullptr;
+    file = nullptr;
+#else
+    if (data) {
+        munmap(const_cast<char *>(data), size);
+    }
+    if (file >= 0) {
+        ::close(file);
+    }
+    file = -1;
+#endif
+    data = nullptr;
+    size = 0;
+    opened = false;
+}
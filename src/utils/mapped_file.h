@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+
+
+namespace cg::utils {
+    // Read-only memory mapping of a whole file. A missing file is not an error, is_open() just returns false
+    class mapped_file {
+    public:
+        mapped_file() = default;
+        explicit mapped_file(const std::filesystem::path &filepath);
+        ~mapped_file();
+
+        mapped_file(const mapped_file &) = delete;
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        bool is_open() const;
+        const char *get_data() const;
+        size_t get_size() const;
+
+    protected:
+        void close();
+
+        bool opened = false;
+        const char *data = nullptr;
+        size_t size = 0;
+#ifdef _WIN32
+        void *file = nullptr;
+        void *mapping = nullptr;
+#else
+        int file = -1;
+#endif
+    };
+
+    // Finalizer of MurmurHash3, every bit of value flips about half of the bits of the result
+    inline uint64_t mix_bits(uint64_t value) {
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdull;
+        value ^= value >> 33;
+        value *= 0xc4ceb9fe1a85ec53ull;
+        value ^= value >> 33;
+        return value;
+    }
+
+    // 64-bit hash over whole words, each mixed in with mix_bits, then the size. Not cryptographic, good enough
+    // to key caches by file content
+    inline uint64_t hash_bytes(const char *data, size_t size, uint64_t seed = 14695981039346656037ull) {
+        // Keeps a zero word from leaving a zero hash unchanged
+        constexpr uint64_t word_offset = 0x9e3779b97f4a7c15ull;
+        uint64_t hash = seed;
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            hash = mix_bits(hash ^ (word + word_offset));
+        }
+        if (i < size) {
+            uint64_t word = 0;
+            std::memcpy(&word, data + i, size - i);
+            hash = mix_bits(hash ^ (word + word_offset));
+        }
+        return mix_bits(hash ^ static_cast<uint64_t>(size));
+    }
+
+    inline uint64_t hash_combine(uint64_t seed, uint64_t value) {
+        return hash_bytes(reinterpret_cast<const char *>(&value), sizeof(value), seed);
+    }
+}// namespace cg::utils
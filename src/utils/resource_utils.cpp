@@ -7,6 +7,10 @@
 
 #include <stb_image_write.h>
 
+#include <fstream>
+#include <string>
+#include <vector>
+
 
 using namespace cg::utils;
 
@@ -26,3 +30,112 @@ void cg::utils::save_resource(
 
     std::system(view_command.c_str());*/
 }
+
+namespace {
+    // Both formats store little endian values, as they are in memory on the supported platforms
+    template<typename T>
+    void append(std::vector<char> &buffer, const T &value) {
+        const char *bytes = reinterpret_cast<const char *>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    void append_string(std::vector<char> &buffer, const std::string &value) {
+        buffer.insert(buffer.end(), value.c_str(), value.c_str() + value.size() + 1);
+    }
+
+    void append_attribute(std::vector<char> &buffer, const std::string &name, const std::string &type, int32_t size) {
+        append_string(buffer, name);
+        append_string(buffer, type);
+        append(buffer, size);
+    }
+
+    // Portable float map: a text header, then rows of RGB floats from the bottom up
+    std::vector<char> encode_pfm(cg::resource<float3> &hdr_target, int width, int height) {
+        std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+        std::vector<char> buffer(header.begin(), header.end());
+        for (int y = height - 1; y >= 0; --y) {
+            for (int x = 0; x < width; ++x) {
+                const float3 &pixel = hdr_target.item(x, y);
+                append(buffer, pixel.x);
+                append(buffer, pixel.y);
+                append(buffer, pixel.z);
+            }
+        }
+        return buffer;
+    }
+
+    // Single part scanline OpenEXR without compression, with 32 bit float B, G and R channels
+    std::vector<char> encode_exr(cg::resource<float3> &hdr_target, int width, int height) {
+        std::vector<char> buffer;
+        append(buffer, int32_t{20000630});
+        append(buffer, int32_t{2});
+        // Channels are listed in alphabetical order
+        const char *channel_names[] = {"B", "G", "R"};
+        append_attribute(buffer, "channels", "chlist", 3 * (2 + 16) + 1);
+        for (const char *channel_name: channel_names) {
+            append_string(buffer, channel_name);
+            // FLOAT pixels, not perceptually linear, reserved bytes, no subsampling
+            append(buffer, int32_t{2});
+            append(buffer, int32_t{0});
+            append(buffer, int32_t{1});
+            append(buffer, int32_t{1});
+        }
+        buffer.push_back(0);
+        append_attribute(buffer, "compression", "compression", 1);
+        buffer.push_back(0);
+        for (const char *window: {"dataWindow", "displayWindow"}) {
+            append_attribute(buffer, window, "box2i", 16);
+            append(buffer, int32_t{0});
+            append(buffer, int32_t{0});
+            append(buffer, int32_t{width - 1});
+            append(buffer, int32_t{height - 1});
+        }
+        append_attribute(buffer, "lineOrder", "lineOrder", 1);
+        buffer.push_back(0);
+        append_attribute(buffer, "pixelAspectRatio", "float", 4);
+        append(buffer, 1.0f);
+        append_attribute(buffer, "screenWindowCenter", "v2f", 8);
+        append(buffer, 0.0f);
+        append(buffer, 0.0f);
+        append_attribute(buffer, "screenWindowWidth", "float", 4);
+        append(buffer, 1.0f);
+        buffer.push_back(0);
+        // Offset table of the scanlines, each is its y, its size and the rows of the channels
+        auto line_size = static_cast<int32_t>(3 * width * sizeof(float));
+        uint64_t offset = buffer.size() + height * sizeof(uint64_t);
+        for (int y = 0; y < height; ++y) {
+            append(buffer, offset);
+            offset += 2 * sizeof(int32_t) + line_size;
+        }
+        for (int y = 0; y < height; ++y) {
+            append(buffer, int32_t{y});
+            append(buffer, line_size);
+            for (int channel = 2; channel >= 0; --channel) {
+                for (int x = 0; x < width; ++x) {
+                    append(buffer, hdr_target.item(x, y)[channel]);
+                }
+            }
+        }
+        return buffer;
+    }
+}// namespace
+
+void cg::utils::save_hdr_resource(cg::resource<float3> &hdr_target, std::filesystem::path filepath) {
+    int width = static_cast<int>(hdr_target.get_stride());
+    int height = static_cast<int>(hdr_target.get_number_of_elements()) / width;
+
+    std::vector<char> buffer;
+    if (filepath.extension() == ".pfm") {
+        buffer = encode_pfm(hdr_target, width, height);
+    }
+    else if (filepath.extension() == ".exr") {
+        buffer = encode_exr(hdr_target, width, height);
+    }
+    else {
+        THROW_ERROR("HDR results are saved as .pfm or .exr");
+    }
+
+    std::ofstream file(filepath, std::ios::binary);
+    file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    if (!file) THROW_ERROR("Can't save the resource");
+}
@@ -7,4 +7,7 @@
 
 namespace cg::utils {
     void save_resource(cg::resource<cg::unsigned_color> &render_target, std::filesystem::path filepath);
+
+    // Writes linear float RGB without loss, as PFM or as uncompressed OpenEXR depending on the extension
+    void save_hdr_resource(cg::resource<float3> &hdr_target, std::filesystem::path filepath);
 }
\ No newline at end of file
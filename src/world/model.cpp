@@ -3,9 +3,12 @@
 #include "model.h"
 
 #include "utils/error_handler.h"
+#include "utils/mapped_file.h"
 
 #include <linalg.h>
 #include <iostream>
+#include <sstream>
+#include <string_view>
 
 
 using namespace linalg::aliases;
@@ -30,6 +33,39 @@ namespace cg::world {
         fill_buffers(reader.GetShapes(), reader.GetAttrib(), reader.GetMaterials(), model_path.parent_path());
     }
 
+    uint64_t model::get_content_hash(const std::filesystem::path &model_path) {
+        cg::utils::mapped_file obj_file(model_path);
+        if (!obj_file.is_open()) {
+            THROW_ERROR("Can't open model file " + model_path.string());
+        }
+        // hash_bytes folds the size of every file into the hash as well
+        uint64_t hash = cg::utils::hash_bytes(obj_file.get_data(), obj_file.get_size());
+
+        std::string_view content(obj_file.get_data(), obj_file.get_size());
+        size_t line_start = 0;
+        while (line_start < content.size()) {
+            size_t line_end = content.find('\n', line_start);
+            if (line_end == std::string_view::npos) {
+                line_end = content.size();
+            }
+            std::string_view line = content.substr(line_start, line_end - line_start);
+            line_start = line_end + 1;
+            if (line.substr(0, 7) != "mtllib ") {
+                continue;
+            }
+            std::istringstream names(std::string(line.substr(7)));
+            std::string name;
+            while (names >> name) {
+                cg::utils::mapped_file mtl_file(model_path.parent_path() / name);
+                hash = cg::utils::hash_bytes(name.data(), name.size(), hash);
+                if (mtl_file.is_open()) {
+                    hash = cg::utils::hash_bytes(mtl_file.get_data(), mtl_file.get_size(), hash);
+                }
+            }
+        }
+        return hash;
+    }
+
     void model::allocate_buffers(const std::vector<tinyobj::shape_t> &shapes) {
         for (const auto &shape: shapes) {
             unsigned int vertex_buffer_size = 0;
@@ -161,11 +197,11 @@ namespace cg::world {
 
 
     const float4x4 model::get_world_matrix() const {
-        return float4x4{
-                {1, 0, 0, 0},
-                {0, 1, 0, 0},
-                {0, 0, 1, 0},
-                {0, 0, 0, 1}};
+        return world_matrix;
+    }
+
+    void model::set_world_matrix(const float4x4 &in_world_matrix) {
+        world_matrix = in_world_matrix;
     }
 
 }
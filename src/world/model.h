@@ -2,6 +2,7 @@
 
 #include "resource.h"
 
+#include <cstdint>
 #include <filesystem>
 #include <linalg.h>
 #include <tiny_obj_loader.h>
@@ -18,12 +19,15 @@ namespace cg::world
 		virtual ~model();
 
 		void load_obj(const std::filesystem::path& model_path);
+		// Hash of the OBJ file and of the MTL libraries it references
+		static uint64_t get_content_hash(const std::filesystem::path& model_path);
 
 		const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& get_vertex_buffers() const;
 		const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& get_index_buffers() const;
 		const std::vector<std::filesystem::path>& get_per_shape_texture_files() const;
 
 		const float4x4 get_world_matrix() const;
+		void set_world_matrix(const float4x4& in_world_matrix);
 
 	protected:
 
@@ -31,6 +35,8 @@ namespace cg::world
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::filesystem::path> textures;
 
+		float4x4 world_matrix = linalg::identity;
+
 		void allocate_buffers(const std::vector<tinyobj::shape_t>& shapes);
 		static float3 compute_normal(const tinyobj::attrib_t& attrib, const tinyobj::mesh_t& mesh, size_t index_offset);
 		static void fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, tinyobj::index_t idx, float3 computed_normal, tinyobj::material_t material);